@@ -0,0 +1,129 @@
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+#include <google/protobuf/arena.h>
+
+#include "../shared/dfslib-shared.h"
+#include "../server-node/dfslib-servernode.h"
+#include "../service/dfs-service.pb.h"
+
+/**
+ * Counts the heap allocations of the message patterns the server uses for
+ * DFSList and for streaming a file, before and after the per-call arenas and
+ * reused chunk responses. Build it against the generated dfs-service.pb.h and
+ * libprotobuf, then run it with the number of files and chunks to try:
+ *
+ *     dfs-alloc-bench [files] [chunks]
+ */
+
+using dfs_service::GetResponse;
+using dfs_service::ListResponse;
+
+/** Number of operator new calls since the program started **/
+static std::atomic<std::uint64_t> allocations(0);
+
+void *operator new(std::size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void *memory = std::malloc(size == 0 ? 1 : size);
+    if (memory == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+void operator delete(void *memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void *memory, std::size_t) noexcept
+{
+    std::free(memory);
+}
+
+/**
+ * Fill a listing the way ListMetadata does from the metadata table
+ *
+ * @param response
+ * @param filenames
+ */
+static void FillListing(ListResponse *response, const std::vector<std::string> &filenames)
+{
+    response->mutable_fileinfo()->Reserve(filenames.size());
+    for (std::size_t i = 0; i < filenames.size(); i++)
+    {
+        auto *fileinfo = response->add_fileinfo();
+        fileinfo->set_filename(filenames[i]);
+        fileinfo->set_mtime(1700000000 + i);
+    }
+}
+
+/**
+ * Run a step and report how many allocations it made
+ *
+ * @param label
+ * @param step
+ */
+template <typename Step>
+static void Measure(const char *label, Step step)
+{
+    std::uint64_t before = allocations.load(std::memory_order_relaxed);
+    step();
+    std::uint64_t after = allocations.load(std::memory_order_relaxed);
+    std::printf("%-44s %12llu allocations\n", label, static_cast<unsigned long long>(after - before));
+}
+
+int main(int argc, char **argv)
+{
+    int files = argc > 1 ? std::atoi(argv[1]) : 100000;
+    int chunks = argc > 2 ? std::atoi(argv[2]) : 4096;
+    std::vector<char> chunk(DFS_CHUNK_SIZE, 'x');
+    std::vector<std::string> filenames;
+    for (int i = 0; i < files; i++)
+    {
+        char filename[64];
+        std::snprintf(filename, sizeof(filename), "project/src/module-%06d.cpp", i);
+        filenames.emplace_back(filename);
+    }
+
+    std::printf("listing %d files, streaming %d chunks of %d bytes\n", files, chunks, DFS_CHUNK_SIZE);
+
+    Measure("list, heap ListResponse (before)", [&]
+            {
+        ListResponse response;
+        FillListing(&response, filenames); });
+
+    Measure("list, per-call arena (after)", [&]
+            {
+        google::protobuf::ArenaOptions options;
+        options.start_block_size = DFS_ARENA_START_BLOCK;
+        options.max_block_size = DFS_ARENA_MAX_BLOCK;
+        google::protobuf::Arena arena(options);
+        ListResponse *response = google::protobuf::Arena::CreateMessage<ListResponse>(&arena);
+        FillListing(response, filenames); });
+
+    Measure("stream, new GetResponse per chunk (before)", [&]
+            {
+        for (int i = 0; i < chunks; i++)
+        {
+            GetResponse response;
+            response.set_filechunk(chunk.data(), chunk.size());
+        } });
+
+    Measure("stream, reused GetResponse (after)", [&]
+            {
+        GetResponse response;
+        for (int i = 0; i < chunks; i++)
+        {
+            response.mutable_filechunk()->assign(chunk.data(), chunk.size());
+        } });
+
+    return 0;
+}
@@ -1,8 +1,10 @@
 #include <regex>
 #include <mutex>
 #include <vector>
+#include <unordered_set>
 #include <string>
 #include <thread>
+#include <condition_variable>
 #include <cstdio>
 #include <chrono>
 #include <errno.h>
@@ -14,8 +16,11 @@
 #include <getopt.h>
 #include <unistd.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include <sys/inotify.h>
 #include <grpcpp/grpcpp.h>
+#include <grpc/compression.h>
 #include <utime.h>
 
 //#include "src/dfs-utils.h"
@@ -27,6 +32,7 @@
 using grpc::Channel;
 using grpc::ClientContext;
 using grpc::ClientReader;
+using grpc::ClientReaderWriter;
 using grpc::ClientWriter;
 using grpc::Status;
 using grpc::StatusCode;
@@ -40,22 +46,367 @@ using dfs_service::DeleteResponse;
 using dfs_service::DFSService;
 using dfs_service::GetRequest;
 using dfs_service::GetResponse;
+using dfs_service::GetFilesRequest;
+using dfs_service::GetFilesResponse;
 using dfs_service::ListRequest;
 using dfs_service::ListResponse;
 using dfs_service::LockRequest;
 using dfs_service::LockResponse;
 using dfs_service::StatusRequest;
+using dfs_service::SignatureRequest;
+using dfs_service::SignatureResponse;
 using dfs_service::StatusResponse;
 using dfs_service::StoreRequest;
 using dfs_service::StoreResponse;
+using dfs_service::StoreFilesRequest;
+using dfs_service::StoreFilesResponse;
+using dfs_service::SyncRequest;
+using dfs_service::SyncResponse;
+using dfs_service::UploadRequest;
+using dfs_service::UploadResponse;
 
 extern dfs_log_level_e DFS_LOG_LEVEL;
 
 using FileRequestType = ListRequest;
 using FileListResponseType = ListResponse;
 
-DFSClientNodeP2::DFSClientNodeP2() : DFSClientNode() {}
-DFSClientNodeP2::~DFSClientNodeP2() {}
+DFSSyncSession::DFSSyncSession(DFSService::Stub *stub, const std::string &cid, NoticeHandler on_notice)
+    : cid(cid), on_notice(std::move(on_notice))
+{
+    this->stream = stub->DFSSync(&this->context);
+    this->reader = std::thread(&DFSSyncSession::ReadLoop, this);
+}
+
+DFSSyncSession::~DFSSyncSession()
+{
+    this->context.TryCancel();
+    if (this->reader.joinable())
+    {
+        this->reader.join();
+    }
+}
+
+bool DFSSyncSession::Ok()
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return !this->broken;
+}
+
+/**
+ * @brief Sends a command over the stream and waits for its responses.
+ *
+ * The command is registered before it is written so no response can arrive
+ * unclaimed. The handler runs on the reader thread for every response of the
+ * command. A command that times out is unregistered, and the call returns only
+ * once the handler is no longer running, so the handler may capture locals.
+ *
+ * @param request The command to send. Its id is assigned here.
+ * @param timeout_ms How long to wait for the last response.
+ * @param handler Called with each response, may be empty.
+ * @return StatusCode The status code of the command, or:
+ * - StatusCode::DEADLINE_EXCEEDED if the last response did not arrive in time.
+ * - StatusCode::CANCELLED if the handler stopped receiving the responses.
+ * - StatusCode::UNAVAILABLE if the stream broke before the last response arrived.
+ */
+StatusCode DFSSyncSession::Call(SyncRequest *request, int timeout_ms, Handler handler)
+{
+    auto call = std::make_shared<Pending>();
+    call->handler = std::move(handler);
+    std::uint64_t id;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (this->broken)
+        {
+            return StatusCode::UNAVAILABLE;
+        }
+        id = this->next_id++;
+        this->pending[id] = call;
+    }
+    request->set_id(id);
+
+    bool written = false;
+    {
+        std::lock_guard<std::mutex> lock(this->write_mutex);
+        if (!this->stream_finished)
+        {
+            if (!this->cid_sent)
+            {
+                request->set_cid(this->cid);
+            }
+            written = this->stream->Write(*request);
+            this->cid_sent = this->cid_sent || written;
+            request->clear_cid();
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(this->mutex);
+    if (!written)
+    {
+        this->pending.erase(id);
+        return StatusCode::UNAVAILABLE;
+    }
+    if (!this->done_cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), [&]
+                                { return call->done; }))
+    {
+        this->pending.erase(id);
+        this->done_cv.wait(lock, [&]
+                           { return !call->in_handler; });
+        return StatusCode::DEADLINE_EXCEEDED;
+    }
+    return call->code;
+}
+
+/**
+ * Dispatches responses to the waiting commands until the stream ends,
+ * then fails whatever is still waiting.
+ */
+void DFSSyncSession::ReadLoop()
+{
+    SyncResponse response;
+    while (this->stream->Read(&response))
+    {
+        if (response.id() == 0)
+        {
+            if (response.has_notice() && this->on_notice)
+            {
+                this->on_notice(response.notice());
+            }
+            continue;
+        }
+
+        std::shared_ptr<Pending> call;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            auto found = this->pending.find(response.id());
+            if (found == this->pending.end())
+            {
+                // timed out or stopped by its handler
+                continue;
+            }
+            call = found->second;
+            call->in_handler = true;
+        }
+
+        bool keep = !call->handler || call->handler(response);
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            call->in_handler = false;
+            if (!keep || !response.more())
+            {
+                call->done = true;
+                call->code = keep ? static_cast<StatusCode>(response.code()) : StatusCode::CANCELLED;
+                this->pending.erase(response.id());
+            }
+        }
+        this->done_cv.notify_all();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->broken = true;
+        for (auto &waiting : this->pending)
+        {
+            waiting.second->done = true;
+            waiting.second->code = StatusCode::UNAVAILABLE;
+        }
+        this->pending.clear();
+    }
+    this->done_cv.notify_all();
+
+    std::lock_guard<std::mutex> lock(this->write_mutex);
+    this->stream_finished = true;
+    Status status = this->stream->Finish();
+    if (!status.ok())
+    {
+        dfs_log(LL_DEBUG2) << "Sync session ended: " << status.error_message();
+    }
+}
+
+DFSClientNodeP2::DFSClientNodeP2() : DFSClientNode()
+{
+    dfs_env_compression_level(&this->compression_level);
+}
+
+DFSClientNodeP2::~DFSClientNodeP2()
+{
+    {
+        std::lock_guard<std::mutex> lock(sync_notices_mutex);
+        sync_stopping = true;
+    }
+    sync_notices_cv.notify_all();
+    if (sync_notice_thread.joinable())
+    {
+        sync_notice_thread.join();
+    }
+    std::lock_guard<std::mutex> lock(sync_session_mutex);
+    sync_session.reset();
+}
+
+/**
+ * @brief Returns the DFSSync session shared by the calls of this client node,
+ *        opening a new one if there is none or the last one broke.
+ *
+ * A server that does not take sync sessions breaks the stream right away, so
+ * after a break no new session is tried for DFS_RESET_TIMEOUT milliseconds and
+ * the callers make their calls directly in the meantime.
+ *
+ * @return std::shared_ptr<DFSSyncSession> The session, or nullptr while none may be opened.
+ */
+std::shared_ptr<DFSSyncSession> DFSClientNodeP2::SyncSession()
+{
+    std::lock_guard<std::mutex> lock(sync_session_mutex);
+    if (sync_session && sync_session->Ok())
+    {
+        return sync_session;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (now < sync_retry_at)
+    {
+        return nullptr;
+    }
+    sync_retry_at = now + std::chrono::milliseconds(DFS_RESET_TIMEOUT);
+
+    sync_session = std::make_shared<DFSSyncSession>(service_stub.get(), client_id,
+                                                    [this](const ListResponse::FileInfo &notice)
+                                                    { QueueSyncNotice(notice); });
+    if (!sync_notice_thread.joinable())
+    {
+        sync_notice_thread = std::thread(&DFSClientNodeP2::HandleSyncNotices, this);
+    }
+    return sync_session;
+}
+
+bool DFSClientNodeP2::SyncCall(SyncRequest *request, DFSSyncSession::Handler handler, StatusCode *code)
+{
+    std::shared_ptr<DFSSyncSession> session = SyncSession();
+    if (!session)
+    {
+        return false;
+    }
+    StatusCode sync_code = session->Call(request, deadline_timeout, std::move(handler));
+    if (sync_code == StatusCode::UNAVAILABLE)
+    {
+        return false;
+    }
+    *code = sync_code;
+    return true;
+}
+
+void DFSClientNodeP2::QueueSyncNotice(const ListResponse::FileInfo &notice)
+{
+    {
+        std::lock_guard<std::mutex> lock(sync_notices_mutex);
+        sync_notices.push_back(notice);
+    }
+    sync_notices_cv.notify_one();
+}
+
+/**
+ * @brief Brings the files named in the server's change notices up to date.
+ *
+ * Runs on its own thread because the fetches themselves go over the sync
+ * session whose reader thread delivers the notices. Like HandleCallbackList,
+ * a file is only fetched when the server copy is more recent, and the work is
+ * done under the watcher mutex.
+ */
+void DFSClientNodeP2::HandleSyncNotices()
+{
+    std::unique_lock<std::mutex> lock(sync_notices_mutex);
+    while (true)
+    {
+        sync_notices_cv.wait(lock, [&]
+                             { return sync_stopping || !sync_notices.empty(); });
+        if (sync_stopping)
+        {
+            return;
+        }
+        ListResponse::FileInfo notice = std::move(sync_notices.front());
+        sync_notices.pop_front();
+        lock.unlock();
+
+        {
+            std::lock_guard<std::mutex> watcher_lock(watcher_handle_mutex);
+            struct stat filestat;
+            if (stat(WrapPath(notice.filename()).c_str(), &filestat) != 0 || filestat.st_mtime < notice.mtime())
+            {
+                std::cout << "Fetching changed file from server: " << notice.filename() << std::endl;
+                if (notice.inlined())
+                {
+                    FetchInlined(notice.filename(), notice.content(), notice.crc(), notice.mtime());
+                }
+                else
+                {
+                    Fetch(notice.filename());
+                }
+            }
+        }
+        lock.lock();
+    }
+}
+
+/**
+ * @brief Fetches a byte range over the DFSSync session instead of a DFSGetFile call.
+ *
+ * Behaves like FetchRange: the chunks are written at their offset and received
+ * counts the bytes written, even when the fetch fails part way.
+ *
+ * @param filename The name of the file to be fetched from the server.
+ * @param fd The file descriptor the chunks are written to.
+ * @param offset The first byte to fetch.
+ * @param length The number of bytes to fetch, 0 fetches through to the end of the file.
+ * @param received Set to the number of bytes written.
+ * @param code Set to the status code of the fetch.
+ * @return bool false if there is no session and FetchRange should be used.
+ */
+bool DFSClientNodeP2::FetchRangeSync(const std::string &filename, int fd, std::int64_t offset,
+                                     std::int64_t length, std::int64_t *received, StatusCode *code)
+{
+    SyncRequest request;
+    GetRequest *get = request.mutable_fetch();
+    get->set_filename(filename);
+    get->set_offset(offset);
+    get->set_length(length);
+
+    *received = 0;
+    return SyncCall(&request, [&](SyncResponse &response)
+                    {
+        const std::string &chunk = response.chunk().filechunk();
+        if (!dfs_pwrite_all(fd, chunk.data(), chunk.size(), offset + *received))
+        {
+            return false;
+        }
+        *received += chunk.size();
+        return true; },
+                    code);
+}
+
+void DFSClientNodeP2::SetCompressionLevel(grpc_compression_level level)
+{
+    this->compression_level = level;
+}
+
+/**
+ * @brief Picks the algorithm for the configured compression level and applies it
+ *        to the messages the client sends on a call.
+ *
+ * The client API only takes an algorithm, so the level is mapped the same way the
+ * server maps its own. The server advertises every algorithm it was built with and
+ * decompresses whichever one the messages carry. Files whose first bytes look
+ * already compressed or encrypted are sent as they are.
+ *
+ * @param context The context of the call about to be started.
+ * @param sample The start of the file being sent.
+ * @param sample_size The number of bytes available at sample.
+ */
+void DFSClientNodeP2::SetCallCompression(ClientContext *context, const char *sample, std::size_t sample_size)
+{
+    if (this->compression_level == GRPC_COMPRESS_LEVEL_NONE || !dfs_is_compressible(sample, sample_size))
+    {
+        return;
+    }
+    const uint32_t all_algorithms = (1u << GRPC_COMPRESS_ALGORITHMS_COUNT) - 1;
+    context->set_compression_algorithm(grpc_compression_algorithm_for_level(this->compression_level, all_algorithms));
+}
 
 /**
  * @brief Requests a write lock for a given file at the server, ensuring that the
@@ -78,28 +429,779 @@ grpc::StatusCode DFSClientNodeP2::RequestWriteAccess(const std::string &filename
     request.set_filename(filename);
     request.set_cid(client_id);
 
+    LockResponse response;
+    Status status;
+    SyncRequest command;
+    *command.mutable_lock() = request;
+    StatusCode sync_code;
+    if (SyncCall(&command, [&](SyncResponse &reply)
+                 { response.Swap(reply.mutable_lock()); return true; },
+                 &sync_code))
+    {
+        status = Status(sync_code, "");
+    }
+    else
+    {
+        // Set deadline
+        ClientContext context;
+        auto deadline = std::chrono::system_clock::now() +
+                        std::chrono::milliseconds(deadline_timeout);
+        context.set_deadline(deadline);
+
+        status = service_stub->DFSRequestLock(&context, request, &response);
+    }
+
+    if (status.ok())
+    {
+        // lock obtained
+        return StatusCode::OK;
+    }
+    else if (status.error_code() == StatusCode::DEADLINE_EXCEEDED)
+    {
+        return StatusCode::DEADLINE_EXCEEDED;
+    }
+    else if (status.error_code() == StatusCode::RESOURCE_EXHAUSTED)
+    {
+        return StatusCode::RESOURCE_EXHAUSTED;
+    }
+    else
+    {
+        return StatusCode::CANCELLED;
+    }
+}
+
+/**
+ * @brief Opens an upload session on the server, or asks how far an existing one got.
+ *
+ * A new session requires the write lock to be held already. When `resume_id` names a
+ * session the server still has, the returned offset is the number of bytes it holds
+ * durably and the upload continues from there.
+ *
+ * @param filename The name of the file being uploaded.
+ * @param resume_id The session to resume, or empty to open a new one.
+ * @param session_id Set to the session the upload continues in.
+ * @param offset Set to the number of bytes the server already holds.
+ * @return StatusCode The status of the request:
+ * - StatusCode::OK if the session is open.
+ * - StatusCode::DEADLINE_EXCEEDED if the timeout deadline is reached before a response is received.
+ * - StatusCode::NOT_FOUND if the session to resume is unknown to the server.
+ * - StatusCode::RESOURCE_EXHAUSTED if the write lock is not held.
+ * - StatusCode::CANCELLED if the operation is canceled due to an error or timeout.
+ */
+grpc::StatusCode DFSClientNodeP2::OpenUpload(const std::string &filename, const std::string &resume_id,
+                                             std::string *session_id, std::int64_t *offset)
+{
+    UploadRequest request;
+    request.set_filename(filename);
+    request.set_cid(client_id);
+    request.set_session_id(resume_id);
+
+    // Set deadline
+    ClientContext context;
+    auto deadline = std::chrono::system_clock::now() +
+                    std::chrono::milliseconds(deadline_timeout);
+    context.set_deadline(deadline);
+
+    UploadResponse response;
+    Status status = service_stub->DFSOpenUpload(&context, request, &response);
+
+    if (status.ok())
+    {
+        *session_id = response.session_id();
+        *offset = response.offset();
+        return StatusCode::OK;
+    }
+    else if (status.error_code() == StatusCode::DEADLINE_EXCEEDED ||
+             status.error_code() == StatusCode::NOT_FOUND ||
+             status.error_code() == StatusCode::RESOURCE_EXHAUSTED)
+    {
+        return status.error_code();
+    }
+    else
+    {
+        return StatusCode::CANCELLED;
+    }
+}
+
+/**
+ * @brief Uploads a file as a delta against the version the server already holds.
+ *
+ * The server returns a rolling checksum and a CRC for each block of its copy, and
+ * dfs_compute_delta turns the local file into block references and literal ranges.
+ * Consecutive block references are merged, so appending to a large file costs roughly
+ * the size of the appended data. The server rebuilds the file and checks it against
+ * the local CRC before committing it.
+ *
+ * @param filename The name of the file to be stored on the server.
+ * @param client_crc The CRC of the local file.
+ * @return StatusCode The status of the operation:
+ * - StatusCode::OK if the file is successfully stored.
+ * - StatusCode::DEADLINE_EXCEEDED if the timeout deadline is reached before a response is received.
+ * - StatusCode::NOT_FOUND if the local file cannot be opened.
+ * - StatusCode::RESOURCE_EXHAUSTED if the write lock cannot be obtained.
+ * - StatusCode::FAILED_PRECONDITION if the delta cannot be used and the file should be sent in full.
+ * - StatusCode::CANCELLED if the operation is canceled due to an error or timeout.
+ */
+grpc::StatusCode DFSClientNodeP2::StoreDelta(const std::string &filename, std::uint32_t client_crc)
+{
+    DFSMappedFile local_file;
+    if (!local_file.Open(WrapPath(filename)))
+    {
+        return StatusCode::NOT_FOUND;
+    }
+
+    StatusCode lock_status = RequestWriteAccess(filename);
+    if (lock_status != StatusCode::OK)
+    {
+        return lock_status;
+    }
+
+    // Get the signatures of the server's copy
+    SignatureRequest signature_request;
+    signature_request.set_filename(filename);
+
+    ClientContext signature_context;
+    signature_context.set_deadline(std::chrono::system_clock::now() +
+                                   std::chrono::milliseconds(deadline_timeout));
+
+    SignatureResponse signatures;
+    Status signature_status = service_stub->DFSGetSignatures(&signature_context, signature_request, &signatures);
+    if (signature_status.error_code() == StatusCode::DEADLINE_EXCEEDED)
+    {
+        return StatusCode::DEADLINE_EXCEEDED;
+    }
+    else if (!signature_status.ok() || signatures.block_size() <= 0)
+    {
+        return StatusCode::FAILED_PRECONDITION;
+    }
+
+    std::vector<DFSDeltaOp> ops = dfs_compute_delta(local_file.Data(), local_file.Size(),
+                                                    signatures.block_size(), signatures.signature(),
+                                                    &this->crc_table);
+
+    // Set deadline
+    ClientContext context;
+    auto deadline = std::chrono::system_clock::now() +
+                    std::chrono::milliseconds(deadline_timeout);
+    context.set_deadline(deadline);
+    SetCallCompression(&context, local_file.Data(), local_file.Size());
+
+    StoreResponse response;
+    std::unique_ptr<ClientWriter<StoreRequest>> writer(service_stub->DFSStoreFile(&context, &response));
+
+    // Each message copies its block range first, then carries up to a chunk of literal bytes
+    StoreRequest request;
+    request.set_filename(filename);
+    request.set_delta(true);
+    request.set_crc(client_crc);
+    request.set_size(local_file.Size());
+    for (std::size_t i = 0; i < ops.size(); i++)
+    {
+        if (ops[i].copy)
+        {
+            request.set_copy_offset(ops[i].offset);
+            request.set_copy_length(ops[i].length);
+            // a following literal range rides in the same message
+            if (i + 1 < ops.size() && !ops[i + 1].copy)
+            {
+                continue;
+            }
+            if (!writer->Write(request))
+            {
+                break;
+            }
+            request.clear_copy_offset();
+            request.clear_copy_length();
+            continue;
+        }
+
+        bool stream_ok = true;
+        for (std::int64_t sent = 0; sent < ops[i].length && stream_ok; sent += DFS_CHUNK_SIZE)
+        {
+            std::int64_t chunk_size = std::min<std::int64_t>(DFS_CHUNK_SIZE, ops[i].length - sent);
+            request.set_filechunk(local_file.Data() + ops[i].offset + sent, chunk_size);
+            stream_ok = writer->Write(request);
+            request.clear_copy_offset();
+            request.clear_copy_length();
+        }
+        request.clear_filechunk();
+        if (!stream_ok)
+        {
+            break;
+        }
+    }
+
+    writer->WritesDone();
+    Status writer_status = writer->Finish();
+
+    // Check status and return corresponding status
+    if (writer_status.ok())
+    {
+        return StatusCode::OK;
+    }
+    else if (writer_status.error_code() == StatusCode::DEADLINE_EXCEEDED)
+    {
+        return StatusCode::DEADLINE_EXCEEDED;
+    }
+    else if (writer_status.error_code() == StatusCode::DATA_LOSS ||
+             writer_status.error_code() == StatusCode::FAILED_PRECONDITION)
+    {
+        return StatusCode::FAILED_PRECONDITION;
+    }
+    else
+    {
+        return StatusCode::CANCELLED;
+    }
+}
+
+/**
+ * @brief Connects to the gRPC service to store a file while ensuring that the file
+ *        is not already present on the server. A write lock is requested before
+ *        attempting to store the file, and the operation is canceled if the lock
+ *        cannot be obtained.
+ *
+ * This method first checks if the file already exists on the server. If the server
+ * responds with an ALREADY_EXISTS error, indicating the file has not changed,
+ * the operation is skipped. Otherwise, a write lock is requested before proceeding
+ * to store the file. If the lock request fails (due to RESOURCE_EXHAUSTED error),
+ * the operation is canceled, and a RESOURCE_EXHAUSTED status is returned.
+ *
+ * When the server already holds a version of a file of at least DFS_DELTA_MIN_FILE
+ * bytes, StoreDelta sends only the changed blocks. Otherwise, or when the delta cannot
+ * be applied, the upload runs in a server-side session. If it is interrupted, the session is
+ * remembered and the next Store of the same local version resumes it from the
+ * last durable offset, without requesting the write lock again.
+ *
+ * @param filename The name of the file to be stored on the server.
+ * @return StatusCode The status of the operation:
+ * - StatusCode::OK if the file is successfully stored.
+ * - StatusCode::DEADLINE_EXCEEDED if the timeout deadline is reached before a response is received.
+ * - StatusCode::ALREADY_EXISTS if the file on the server is identical to the local cached file.
+ * - StatusCode::RESOURCE_EXHAUSTED if the write lock cannot be obtained.
+ * - StatusCode::INVALID_ARGUMENT if the file is a download staged by this client.
+ * - StatusCode::CANCELLED if the operation is canceled due to an error or timeout.
+ */
+grpc::StatusCode DFSClientNodeP2::Store(const std::string &filename)
+{
+    if (IsFetchTempFile(filename))
+    {
+        return StatusCode::INVALID_ARGUMENT;
+    }
+
+    FileStatus file_status;
+    StatusCode status = Stat(filename, &file_status);
+    if (status == StatusCode::OK || status == StatusCode::NOT_FOUND)
+    {
+        // compare client and server mtime via crc
+        std::uint32_t client_crc = dfs_file_checksum(WrapPath(filename), &this->crc_table);
+        if (client_crc != static_cast<uint32_t>(file_status.server_crc))
+        { // diff in client and server crc
+            // Open file and check for existence
+            std::ifstream filestream(WrapPath(filename), std::ios::binary);
+            struct stat filestat;
+            if (!filestream.is_open() || stat(WrapPath(filename).c_str(), &filestat) != 0)
+            {
+                return StatusCode::NOT_FOUND;
+            }
+
+            // resume an interrupted upload of the same local version
+            std::string resume_id;
+            {
+                std::lock_guard<std::mutex> lock(upload_sessions_mutex);
+                auto session = upload_sessions.find(filename);
+                if (session != upload_sessions.end() &&
+                    session->second.local_size == filestat.st_size &&
+                    session->second.local_mtime == filestat.st_mtime)
+                {
+                    resume_id = session->second.session_id;
+                }
+                upload_sessions.erase(filename);
+            }
+
+            // send only the changed blocks when the server holds an older version
+            if (resume_id.empty() && status == StatusCode::OK && filestat.st_size >= DFS_DELTA_MIN_FILE)
+            {
+                StatusCode delta_status = StoreDelta(filename, client_crc);
+                if (delta_status != StatusCode::FAILED_PRECONDITION)
+                {
+                    return delta_status;
+                }
+                std::cout << "Client Store: delta upload not possible, sending " << filename << " in full" << std::endl;
+            }
+
+            std::string session_id;
+            std::int64_t offset = 0;
+            StatusCode session_status = StatusCode::NOT_FOUND;
+            if (!resume_id.empty())
+            {
+                session_status = OpenUpload(filename, resume_id, &session_id, &offset);
+            }
+
+            if (session_status == StatusCode::OK)
+            {
+                std::cout << "Client Store: resuming " << filename << " at byte " << offset << std::endl;
+            }
+            else
+            {
+                // request lock
+                StatusCode lock_status = RequestWriteAccess(filename);
+                if (lock_status != StatusCode::OK)
+                {
+                    return lock_status;
+                }
+                session_status = OpenUpload(filename, "", &session_id, &offset);
+                if (session_status != StatusCode::OK)
+                {
+                    return session_status == StatusCode::NOT_FOUND ? StatusCode::CANCELLED : session_status;
+                }
+            }
+
+            // perform store
+            StoreRequest request;
+            request.set_filename(filename);
+            request.set_session_id(session_id);
+            request.set_offset(offset);
+            request.set_size(filestat.st_size);
+
+            // Set deadline
+            ClientContext context;
+            auto deadline = std::chrono::system_clock::now() +
+                            std::chrono::milliseconds(deadline_timeout);
+            context.set_deadline(deadline);
+
+            // sample the start of the file to decide on compression
+            std::vector<char> buffer(DFS_CHUNK_SIZE);
+            filestream.read(buffer.data(), std::min<std::size_t>(buffer.size(), DFS_ENTROPY_SAMPLE_BYTES));
+            SetCallCompression(&context, buffer.data(), filestream.gcount());
+            filestream.clear();
+            filestream.seekg(offset);
+
+            StoreResponse response;
+            std::unique_ptr<ClientWriter<StoreRequest>> writer(service_stub->DFSStoreFile(&context, &response));
+
+            // Send file data in chunks, stopping once the stream breaks
+            while (!filestream.eof())
+            {
+                filestream.read(buffer.data(), buffer.size());
+                request.set_filechunk(buffer.data(), filestream.gcount());
+                if (!writer->Write(request))
+                {
+                    break;
+                }
+            }
+            writer->WritesDone();
+            Status writer_status = writer->Finish();
+
+            // Check status and return corresponding status
+            if (writer_status.ok())
+            {
+                return StatusCode::OK;
+            }
+
+            // keep the session so the next attempt picks up where this one stopped
+            if (writer_status.error_code() != StatusCode::NOT_FOUND)
+            {
+                std::lock_guard<std::mutex> lock(upload_sessions_mutex);
+                upload_sessions[filename] = {session_id, filestat.st_size, filestat.st_mtime};
+            }
+
+            if (writer_status.error_code() == StatusCode::DEADLINE_EXCEEDED)
+            {
+                return StatusCode::DEADLINE_EXCEEDED;
+            }
+            else
+            {
+                return StatusCode::CANCELLED;
+            }
+        }
+        else
+        { // no diff in files
+            // update mtime
+            struct utimbuf recent;
+            recent.modtime = file_status.mtime;
+            utime(WrapPath(filename).c_str(), &recent);
+            std::cout << "Client Store: mod time updated to be equal" << std::endl;
+
+            return StatusCode::ALREADY_EXISTS;
+        }
+    }
+    else
+    {
+        return status;
+    }
+}
+
+/**
+ * @brief Fetches a byte range of a file from the server and writes it in place.
+ *
+ * The received chunks are written with pwrite at the same offset they have in the
+ * server's copy, so the target file is never truncated here. The number of bytes
+ * written is reported through `received` even when the stream fails, which lets
+ * the caller resume from where the transfer stopped.
+ *
+ * @param filename The name of the file to be fetched from the server.
+ * @param fd The open file descriptor the range is written to.
+ * @param offset The first byte of the range.
+ * @param length The number of bytes in the range, 0 to fetch through to the end of the file.
+ * @param received Set to the number of bytes written to the file descriptor.
+ * @return StatusCode The status of the fetch operation:
+ * - StatusCode::OK if the range is successfully fetched.
+ * - StatusCode::DEADLINE_EXCEEDED if the timeout deadline is reached before the range is received.
+ * - StatusCode::NOT_FOUND if the file cannot be found on the server.
+ * - StatusCode::CANCELLED if the operation is canceled due to an error or timeout.
+ */
+grpc::StatusCode DFSClientNodeP2::FetchRange(const std::string &filename, int fd,
+                                             std::int64_t offset, std::int64_t length,
+                                             std::int64_t *received)
+{
+    GetRequest request;
+    request.set_filename(filename);
+    request.set_offset(offset);
+    request.set_length(length);
+
+    // Set deadline
+    ClientContext context;
+    auto deadline = std::chrono::system_clock::now() +
+                    std::chrono::milliseconds(deadline_timeout);
+    context.set_deadline(deadline);
+
+    std::unique_ptr<ClientReader<GetResponse>> reader(service_stub->DFSGetFile(&context, request));
+
+    // Read file chunks and write them at their offset
+    GetResponse response;
+    bool write_failed = false;
+    *received = 0;
+    while (reader->Read(&response))
+    {
+        const std::string &chunk = response.filechunk();
+        if (!dfs_pwrite_all(fd, chunk.data(), chunk.size(), offset + *received))
+        {
+            write_failed = true;
+            context.TryCancel();
+            break;
+        }
+        *received += chunk.size();
+    }
+
+    // Check status and return corresponding status
+    Status status = reader->Finish();
+    if (write_failed)
+    {
+        return StatusCode::CANCELLED;
+    }
+    else if (status.ok())
+    {
+        return StatusCode::OK;
+    }
+    else if (status.error_code() == StatusCode::DEADLINE_EXCEEDED)
+    {
+        return StatusCode::DEADLINE_EXCEEDED;
+    }
+    else if (status.error_code() == StatusCode::NOT_FOUND)
+    {
+        return StatusCode::NOT_FOUND;
+    }
+    else
+    {
+        return StatusCode::CANCELLED;
+    }
+}
+
+/**
+ * @brief Writes a small file from the content the server inlined in a status
+ *        response or a change notice.
+ *
+ * The local copy is compared with the server's CRC first and only its mtime is
+ * updated when they match. Otherwise the content is written to a temporary file
+ * next to the local copy and renamed over it.
+ *
+ * @param filename The name of the file to be written.
+ * @param content The whole file as sent by the server.
+ * @param server_crc The CRC the server reported for its copy.
+ * @param server_mtime The mtime the server reported for its copy.
+ * @return StatusCode The status of the fetch operation:
+ * - StatusCode::OK if the file is successfully written.
+ * - StatusCode::ALREADY_EXISTS if the local cached file is identical to the server's copy.
+ * - StatusCode::CANCELLED if the file cannot be written.
+ */
+grpc::StatusCode DFSClientNodeP2::FetchInlined(const std::string &filename, const std::string &content,
+                                               std::uint32_t server_crc, int server_mtime)
+{
+    if (dfs_file_checksum(WrapPath(filename), &this->crc_table) == server_crc)
+    {
+        struct utimbuf recent;
+        recent.modtime = server_mtime;
+        utime(WrapPath(filename).c_str(), &recent);
+        std::cout << "Client Fetch: mod time updated to be equal" << std::endl;
+        return StatusCode::ALREADY_EXISTS;
+    }
+
+    std::string temp_path = WrapPath(DFS_FETCH_TEMP_PREFIX + filename + ".XXXXXX");
+    int fd = mkostemp(&temp_path[0], O_CLOEXEC);
+    if (fd < 0)
+    {
+        return StatusCode::CANCELLED;
+    }
+    bool written = dfs_pwrite_all(fd, content.data(), content.size(), 0) && fchmod(fd, 0644) == 0;
+    close(fd);
+    if (!written || rename(temp_path.c_str(), WrapPath(filename).c_str()) != 0)
+    {
+        std::remove(temp_path.c_str());
+        return StatusCode::CANCELLED;
+    }
+
+    // a partial fetch of an older version can no longer be resumed
+    DropPartialFetch(filename);
+    return StatusCode::OK;
+}
+
+/**
+ * @brief Stores several files over a single DFSStoreFiles stream.
+ *
+ * The first message asks for the write locks of the whole batch, which the server
+ * takes and later releases together instead of one DFSRequestLock call per file.
+ * The files then follow one after the other, the last message of each flagged eof.
+ * There is no DFSStatus round trip per file: each file carries its crc instead
+ * and the server skips it when its copy is the same. Every stored file takes
+ * the mtime of the server's copy, as Store does for an unchanged file, unless
+ * it changed again while it was sent.
+ *
+ * Files the server could not lock because another client holds them are left out
+ * of unfinished, the same as Store giving up on RESOURCE_EXHAUSTED. Every other
+ * file that was not stored is reported back so the caller can retry it with Store.
+ *
+ * @param filenames The names of the files to be stored on the server.
+ * @param unfinished Set to the files that should be retried one by one.
+ * @return StatusCode The status of the batch:
+ * - StatusCode::OK if the stream completed, even if some files were not stored.
+ * - StatusCode::DEADLINE_EXCEEDED if the timeout deadline is reached before the stream ends.
+ * - StatusCode::CANCELLED if the stream failed.
+ */
+grpc::StatusCode DFSClientNodeP2::StoreBatch(const std::vector<std::string> &filenames,
+                                             std::vector<std::string> *unfinished)
+{
+    // Set deadline
+    ClientContext context;
+    auto deadline = std::chrono::system_clock::now() +
+                    std::chrono::milliseconds(deadline_timeout);
+    context.set_deadline(deadline);
+
+    StoreFilesResponse response;
+    std::unique_ptr<ClientWriter<StoreFilesRequest>> writer(service_stub->DFSStoreFiles(&context, &response));
+
+    StoreFilesRequest request;
+    request.set_cid(client_id);
+    for (const std::string &filename : filenames)
+    {
+        request.add_lock_filename(filename);
+    }
+
+    // Send each file in chunks, stopping once the stream breaks
+    std::vector<char> buffer(DFS_CHUNK_SIZE);
+    std::unordered_map<std::string, time_t> sent_mtimes;
+    bool stream_ok = true;
+    for (std::size_t i = 0; i < filenames.size() && stream_ok; i++)
+    {
+        struct stat filestat;
+        std::ifstream filestream(WrapPath(filenames[i]), std::ios::binary);
+        if (!filestream.is_open() || stat(WrapPath(filenames[i]).c_str(), &filestat) != 0)
+        {
+            continue;
+        }
+        sent_mtimes[filenames[i]] = filestat.st_mtime;
+        request.set_filename(filenames[i]);
+        request.set_crc(dfs_file_checksum(WrapPath(filenames[i]), &this->crc_table));
+        request.set_has_crc(true);
+
+        // a read error ends the file without eof so the server drops it
+        bool eof = false;
+        while (!eof && stream_ok && filestream)
+        {
+            filestream.read(buffer.data(), buffer.size());
+            eof = filestream.eof();
+            request.set_filechunk(buffer.data(), filestream.gcount());
+            request.set_eof(eof);
+            stream_ok = writer->Write(request);
+            request.clear_cid();
+            request.clear_lock_filename();
+            request.clear_crc();
+            request.clear_has_crc();
+        }
+    }
+    writer->WritesDone();
+    Status status = writer->Finish();
+
+    std::unordered_set<std::string> done;
+    for (const auto &result : response.result())
+    {
+        if (result.code() == StatusCode::OK || result.code() == StatusCode::ALREADY_EXISTS)
+        {
+            // match the server's mtime so the next callback list sees the file as in sync
+            struct stat filestat;
+            auto sent = sent_mtimes.find(result.filename());
+            if (sent != sent_mtimes.end() && stat(WrapPath(result.filename()).c_str(), &filestat) == 0 &&
+                filestat.st_mtime == sent->second)
+            {
+                struct utimbuf recent;
+                recent.actime = filestat.st_atime;
+                recent.modtime = result.mtime();
+                utime(WrapPath(result.filename()).c_str(), &recent);
+            }
+            done.insert(result.filename());
+        }
+        else if (result.code() == StatusCode::RESOURCE_EXHAUSTED)
+        {
+            done.insert(result.filename());
+        }
+    }
+    for (const std::string &filename : filenames)
+    {
+        if (done.count(filename) == 0)
+        {
+            unfinished->push_back(filename);
+        }
+    }
+
+    // Check status and return corresponding status
+    if (status.ok())
+    {
+        return StatusCode::OK;
+    }
+    else if (status.error_code() == StatusCode::DEADLINE_EXCEEDED)
+    {
+        return StatusCode::DEADLINE_EXCEEDED;
+    }
+    else
+    {
+        return StatusCode::CANCELLED;
+    }
+}
+
+/**
+ * @brief Fetches several whole files over a single DFSGetFiles stream.
+ *
+ * The server sends the files one after the other. Each one is written to a
+ * temporary file next to its local copy and renamed over it once its last
+ * chunk arrives, so a broken stream never leaves a half written file behind.
+ * The copy takes the server's mtime so the next callback list does not see it
+ * as a local change. Files that were not written, including short ones and
+ * those that disappeared from the server, are reported back so the caller can
+ * fall back to Fetch.
+ *
+ * @param filenames The names of the files to be fetched from the server.
+ * @param unfinished Set to the files that were not written.
+ * @return StatusCode The status of the batch:
+ * - StatusCode::OK if every file was written.
+ * - StatusCode::DEADLINE_EXCEEDED if the timeout deadline is reached before the stream ends.
+ * - StatusCode::CANCELLED if the stream or a local write failed.
+ */
+grpc::StatusCode DFSClientNodeP2::FetchBatch(const std::vector<std::string> &filenames,
+                                             std::vector<std::string> *unfinished)
+{
+    GetFilesRequest request;
+    for (const std::string &filename : filenames)
+    {
+        request.add_filename(filename);
+    }
+
     // Set deadline
     ClientContext context;
     auto deadline = std::chrono::system_clock::now() +
                     std::chrono::milliseconds(deadline_timeout);
     context.set_deadline(deadline);
 
-    LockResponse response;
-    Status status = service_stub->DFSRequestLock(&context, request, &response);
+    std::unique_ptr<ClientReader<GetFilesResponse>> reader(service_stub->DFSGetFiles(&context, request));
 
-    if (status.ok())
+    std::unordered_set<std::string> written;
+    std::string current;
+    std::string temp_path;
+    int fd = -1;
+    std::int64_t offset = 0;
+    std::int64_t server_size = 0;
+    std::int64_t server_mtime = 0;
+    bool write_failed = false;
+    GetFilesResponse response;
+    while (reader->Read(&response))
+    {
+        if (response.missing())
+        {
+            continue;
+        }
+
+        // a new file starts
+        if (fd < 0 || response.filename() != current)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+                std::remove(temp_path.c_str());
+            }
+            current = response.filename();
+            temp_path = WrapPath(DFS_FETCH_TEMP_PREFIX + current + ".XXXXXX");
+            fd = mkostemp(&temp_path[0], O_CLOEXEC);
+            offset = 0;
+            server_size = response.size();
+            server_mtime = response.mtime();
+            if (fd < 0)
+            {
+                write_failed = true;
+                context.TryCancel();
+                break;
+            }
+        }
+
+        const std::string &chunk = response.filechunk();
+        if (!dfs_pwrite_all(fd, chunk.data(), chunk.size(), offset))
+        {
+            write_failed = true;
+            context.TryCancel();
+            break;
+        }
+        offset += chunk.size();
+
+        if (response.eof())
+        {
+            struct timespec times[2];
+            times[0].tv_nsec = UTIME_NOW;
+            times[1].tv_sec = server_mtime;
+            times[1].tv_nsec = 0;
+            bool renamed = offset == server_size && fchmod(fd, 0644) == 0 && futimens(fd, times) == 0 &&
+                           rename(temp_path.c_str(), WrapPath(current).c_str()) == 0;
+            close(fd);
+            fd = -1;
+            if (!renamed)
+            {
+                std::remove(temp_path.c_str());
+                continue;
+            }
+            written.insert(current);
+            DropPartialFetch(current);
+        }
+    }
+    Status status = reader->Finish();
+    if (fd >= 0)
+    {
+        close(fd);
+        std::remove(temp_path.c_str());
+    }
+
+    for (const std::string &filename : filenames)
+    {
+        if (written.count(filename) == 0)
+        {
+            unfinished->push_back(filename);
+        }
+    }
+
+    // Check status and return corresponding status
+    if (status.ok() && !write_failed)
     {
-        // lock obtained
         return StatusCode::OK;
     }
     else if (status.error_code() == StatusCode::DEADLINE_EXCEEDED)
     {
         return StatusCode::DEADLINE_EXCEEDED;
     }
-    else if (status.error_code() == StatusCode::RESOURCE_EXHAUSTED)
-    {
-        return StatusCode::RESOURCE_EXHAUSTED;
-    }
     else
     {
         return StatusCode::CANCELLED;
@@ -107,104 +1209,211 @@ grpc::StatusCode DFSClientNodeP2::RequestWriteAccess(const std::string &filename
 }
 
 /**
- * @brief Connects to the gRPC service to store a file while ensuring that the file
- *        is not already present on the server. A write lock is requested before
- *        attempting to store the file, and the operation is canceled if the lock
- *        cannot be obtained.
+ * @brief Fetches a file as a delta against the stale local copy.
  *
- * This method first checks if the file already exists on the server. If the server
- * responds with an ALREADY_EXISTS error, indicating the file has not changed,
- * the operation is skipped. Otherwise, a write lock is requested before proceeding
- * to store the file. If the lock request fails (due to RESOURCE_EXHAUSTED error),
- * the operation is canceled, and a RESOURCE_EXHAUSTED status is returned.
+ * The signatures of the local copy's blocks go out in the GetRequest. The server
+ * answers with instructions to copy ranges of the local copy and with the bytes
+ * that changed. The new version is rebuilt in a temporary file next to the local
+ * copy, checked against the server's CRC and renamed over the local copy.
  *
- * @param filename The name of the file to be stored on the server.
- * @return StatusCode The status of the operation:
- * - StatusCode::OK if the file is successfully stored.
+ * @param filename The name of the file to be fetched from the server.
+ * @param server_crc The CRC the server reported for its copy.
+ * @return StatusCode The status of the fetch operation:
+ * - StatusCode::OK if the file is successfully fetched.
  * - StatusCode::DEADLINE_EXCEEDED if the timeout deadline is reached before a response is received.
- * - StatusCode::ALREADY_EXISTS if the file on the server is identical to the local cached file.
- * - StatusCode::RESOURCE_EXHAUSTED if the write lock cannot be obtained.
+ * - StatusCode::NOT_FOUND if the file cannot be found on the server.
+ * - StatusCode::FAILED_PRECONDITION if the delta cannot be used and the file should be fetched in full.
  * - StatusCode::CANCELLED if the operation is canceled due to an error or timeout.
  */
-grpc::StatusCode DFSClientNodeP2::Store(const std::string &filename)
+grpc::StatusCode DFSClientNodeP2::FetchDelta(const std::string &filename, std::uint32_t server_crc)
 {
-    FileStatus file_status;
-    StatusCode status = Stat(filename, &file_status);
-    if (status == StatusCode::OK || status == StatusCode::NOT_FOUND)
+    DFSMappedFile basis;
+    if (!basis.Open(WrapPath(filename)))
     {
-        // compare client and server mtime via crc
-        std::uint32_t client_crc = dfs_file_checksum(WrapPath(filename), &this->crc_table);
-        if (client_crc != static_cast<uint32_t>(file_status.server_crc))
-        { // diff in client and server crc
-            // request lock
-            StatusCode lock_status = RequestWriteAccess(filename);
-            if (lock_status == StatusCode::OK)
-            {
-                // perform store
-                // Open file and check for existence
-                std::ifstream filestream(WrapPath(filename), std::ios::binary);
-                if (!filestream.is_open())
-                {
-                    return StatusCode::NOT_FOUND;
-                }
+        return StatusCode::FAILED_PRECONDITION;
+    }
 
-                StoreRequest request;
-                request.set_filename(filename);
+    GetRequest request;
+    request.set_filename(filename);
+    std::size_t block_size = dfs_delta_block_size(basis.Size());
+    request.set_block_size(block_size);
+    dfs_block_signatures(basis.Data(), basis.Size(), block_size, &this->crc_table, request.mutable_signature());
 
-                // Set deadline
-                ClientContext context;
-                auto deadline = std::chrono::system_clock::now() +
-                                std::chrono::milliseconds(deadline_timeout);
-                context.set_deadline(deadline);
+    // rebuild next to the local copy so the rename is atomic
+    std::string temp_path = WrapPath(DFS_FETCH_TEMP_PREFIX + filename + ".XXXXXX");
+    int fd = mkostemp(&temp_path[0], O_CLOEXEC);
+    if (fd < 0)
+    {
+        return StatusCode::FAILED_PRECONDITION;
+    }
 
-                StoreResponse response;
-                std::unique_ptr<ClientWriter<StoreRequest>> writer(service_stub->DFSStoreFile(&context, &response));
+    // Set deadline
+    ClientContext context;
+    auto deadline = std::chrono::system_clock::now() +
+                    std::chrono::milliseconds(deadline_timeout);
+    context.set_deadline(deadline);
 
-                // Send file data in chunks
-                char buffer[256];
-                while (!filestream.eof())
-                {
-                    filestream.read(buffer, sizeof(buffer));
-                    request.set_filechunk(buffer, filestream.gcount());
-                    writer->Write(request);
-                }
-                writer->WritesDone();
-                Status writer_status = writer->Finish();
+    std::unique_ptr<ClientReader<GetResponse>> reader(service_stub->DFSGetFile(&context, request));
 
-                // Check status and return corresponding status
-                if (writer_status.ok())
-                {
-                    return StatusCode::OK;
-                }
-                else if (writer_status.error_code() == StatusCode::DEADLINE_EXCEEDED)
-                {
-                    return StatusCode::DEADLINE_EXCEEDED;
-                }
-                else
-                {
-                    return StatusCode::CANCELLED;
-                }
-            }
-            else
+    // Apply the copies and literal chunks in order
+    GetResponse response;
+    std::int64_t offset = 0;
+    bool apply_failed = false;
+    while (reader->Read(&response))
+    {
+        if (response.copy_length() > 0)
+        {
+            if (response.copy_offset() < 0 ||
+                static_cast<std::uint64_t>(response.copy_offset() + response.copy_length()) > basis.Size() ||
+                !dfs_pwrite_all(fd, basis.Data() + response.copy_offset(), response.copy_length(), offset))
             {
-                return lock_status;
+                apply_failed = true;
+                context.TryCancel();
+                break;
             }
+            offset += response.copy_length();
         }
-        else
-        { // no diff in files
-            // update mtime
-            struct utimbuf recent;
-            recent.modtime = file_status.mtime;
-            utime(WrapPath(filename).c_str(), &recent);
-            std::cout << "Client Store: mod time updated to be equal" << std::endl;
 
-            return StatusCode::ALREADY_EXISTS;
+        const std::string &chunk = response.filechunk();
+        if (!dfs_pwrite_all(fd, chunk.data(), chunk.size(), offset))
+        {
+            apply_failed = true;
+            context.TryCancel();
+            break;
         }
+        offset += chunk.size();
+    }
+    Status status = reader->Finish();
+    fchmod(fd, 0644);
+    close(fd);
+
+    if (!apply_failed && status.ok() && dfs_file_checksum(temp_path, &this->crc_table) == server_crc &&
+        rename(temp_path.c_str(), WrapPath(filename).c_str()) == 0)
+    {
+        return StatusCode::OK;
+    }
+    std::remove(temp_path.c_str());
+
+    // Check status and return corresponding status
+    if (status.error_code() == StatusCode::DEADLINE_EXCEEDED)
+    {
+        return StatusCode::DEADLINE_EXCEEDED;
+    }
+    else if (status.error_code() == StatusCode::NOT_FOUND)
+    {
+        return StatusCode::NOT_FOUND;
     }
     else
     {
-        return status;
+        return StatusCode::FAILED_PRECONDITION;
+    }
+}
+
+bool DFSClientNodeP2::IsFetchTempFile(const std::string &filename)
+{
+    return filename.compare(0, sizeof(DFS_FETCH_TEMP_PREFIX) - 1, DFS_FETCH_TEMP_PREFIX) == 0;
+}
+
+void DFSClientNodeP2::RemoveStaleFetches()
+{
+    DIR *dir = opendir(WrapPath("").c_str());
+    if (dir == NULL)
+    {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_type == DT_REG && IsFetchTempFile(entry->d_name))
+        {
+            dfs_log(LL_SYSINFO) << "Removing stale download " << entry->d_name;
+            std::remove(WrapPath(entry->d_name).c_str());
+        }
+    }
+    closedir(dir);
+}
+
+std::string DFSClientNodeP2::PartialPath(const std::string &filename)
+{
+    return WrapPath(DFS_FETCH_TEMP_PREFIX + filename + ".partial");
+}
+
+void DFSClientNodeP2::DropPartialFetch(const std::string &filename)
+{
+    std::lock_guard<std::mutex> lock(partial_fetches_mutex);
+    if (partial_fetches.erase(filename) > 0)
+    {
+        std::remove(PartialPath(filename).c_str());
+    }
+}
+
+/**
+ * @brief Fetches a large file over several concurrent streams into an open file.
+ *
+ * The file is split into DFS_STRIPE_COUNT ranges, aligned to DFS_CHUNK_SIZE, and each
+ * range is fetched by FetchRange on its own thread and its own DFSGetFile stream. The
+ * ranges land at their own offsets so no reassembly is needed. The last range reads
+ * through to the end of the file in case the file grew after it was stat'ed.
+ *
+ * When a range fails, `received` is set to the bytes written contiguously from the
+ * start of the file, so the resume logic in Fetch can continue from there.
+ *
+ * @param filename The name of the file to be fetched from the server.
+ * @param fd The open file descriptor the file is written to.
+ * @param size The size of the file reported by the server.
+ * @param received Set to the contiguous number of bytes written from the start of the file.
+ * @return StatusCode The status of the fetch operation:
+ * - StatusCode::OK if every range is successfully fetched.
+ * - The first failing range's status otherwise, or StatusCode::CANCELLED if the
+ *   file shrank while it was being fetched.
+ *
+ * Each range maps the server file on its own, so the caller checks the assembled
+ * file against the checksum from Stat before using it.
+ */
+grpc::StatusCode DFSClientNodeP2::FetchStriped(const std::string &filename, int fd,
+                                               std::int64_t size, std::int64_t *received)
+{
+    std::int64_t stripe_size = (size + DFS_STRIPE_COUNT - 1) / DFS_STRIPE_COUNT;
+    stripe_size = (stripe_size + DFS_CHUNK_SIZE - 1) / DFS_CHUNK_SIZE * DFS_CHUNK_SIZE;
+
+    std::vector<std::int64_t> offsets;
+    std::vector<std::int64_t> lengths;
+    for (std::int64_t offset = 0; offset < size; offset += stripe_size)
+    {
+        offsets.push_back(offset);
+        lengths.push_back(std::min(stripe_size, size - offset));
+    }
+    lengths.back() = 0;
+
+    std::vector<StatusCode> statuses(offsets.size(), StatusCode::OK);
+    std::vector<std::int64_t> stripe_received(offsets.size(), 0);
+    std::vector<std::thread> stripes;
+    for (std::size_t i = 0; i < offsets.size(); i++)
+    {
+        stripes.emplace_back([&, i]
+                             { statuses[i] = FetchRange(filename, fd, offsets[i], lengths[i], &stripe_received[i]); });
+    }
+    for (std::thread &stripe : stripes)
+    {
+        stripe.join();
+    }
+
+    // Count the bytes written contiguously from the start of the file
+    *received = 0;
+    for (std::size_t i = 0; i < offsets.size(); i++)
+    {
+        *received += stripe_received[i];
+        if (statuses[i] != StatusCode::OK)
+        {
+            return statuses[i];
+        }
+        if (lengths[i] != 0 && stripe_received[i] != lengths[i])
+        {
+            // the file shrank underneath us
+            return StatusCode::CANCELLED;
+        }
     }
+    return StatusCode::OK;
 }
 
 /**
@@ -218,6 +1427,16 @@ grpc::StatusCode DFSClientNodeP2::Store(const std::string &filename)
  * If the file is not found on the server, a NOT_FOUND error is returned. In case
  * of a timeout, DEADLINE_EXCEEDED is returned.
  *
+ * A full fetch is written to a side file and renamed over the local file only once it
+ * is complete, so an interrupted fetch never leaves a half-written file to be stored
+ * back. When the same server version is fetched again, the transfer resumes from the
+ * last byte of the side file instead of starting over. Files of at least DFS_STRIPE_THRESHOLD
+ * bytes are fetched over several concurrent streams with FetchStriped.
+ *
+ * A stale local copy of at least DFS_DELTA_MIN_FILE bytes is first brought up to date
+ * with FetchDelta, which only transfers the blocks that changed. Small files come back
+ * whole in the status response and are written by FetchInlined without a DFSGetFile call.
+ *
  * @param filename The name of the file to be fetched from the server.
  * @return StatusCode The status of the fetch operation:
  * - StatusCode::OK if the file is successfully fetched.
@@ -231,49 +1450,107 @@ grpc::StatusCode DFSClientNodeP2::Fetch(const std::string &filename)
     // Get the file status
     FileStatus file_status;
     StatusCode status = Stat(filename, &file_status);
-    if (status == StatusCode::OK)
+    if (status == StatusCode::OK && file_status.inlined)
+    {
+        return FetchInlined(filename, file_status.content, file_status.server_crc, file_status.mtime);
+    }
+    else if (status == StatusCode::OK)
     {
         // compare client and server mtime via crc
         std::uint32_t client_crc = dfs_file_checksum(WrapPath(filename), &this->crc_table);
         if (client_crc != static_cast<uint32_t>(file_status.server_crc))
         { // diff in client and server crc
-            GetRequest request;
-            request.set_filename(filename);
-
-            // Set deadline
-            ClientContext context;
-            auto deadline = std::chrono::system_clock::now() +
-                            std::chrono::milliseconds(deadline_timeout);
-            context.set_deadline(deadline);
+            // only pull the changed blocks of a stale local copy
+            struct stat localstat;
+            bool resumable;
+            {
+                std::lock_guard<std::mutex> lock(partial_fetches_mutex);
+                resumable = partial_fetches.count(filename) > 0;
+            }
+            if (!resumable && stat(WrapPath(filename).c_str(), &localstat) == 0 &&
+                localstat.st_size >= DFS_DELTA_MIN_FILE)
+            {
+                StatusCode delta_status = FetchDelta(filename, file_status.server_crc);
+                if (delta_status != StatusCode::FAILED_PRECONDITION)
+                {
+                    return delta_status;
+                }
+                std::cout << "Client Fetch: delta download not possible, fetching " << filename << " in full" << std::endl;
+            }
 
-            std::unique_ptr<ClientReader<GetResponse>> reader(service_stub->DFSGetFile(&context, request));
+            // Stage the download in the side file, kept across failures so it can be resumed
+            std::string partial_path = PartialPath(filename);
+            int fd = open(partial_path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+            if (fd < 0)
+            {
+                return StatusCode::CANCELLED;
+            }
 
-            // Read file chunks and write to the file
-            GetResponse response;
-            std::ofstream downloaded_file(WrapPath(filename), std::ios::binary);
-            while (reader->Read(&response))
+            // Resume when the server version is unchanged since the failure
+            std::int64_t offset = 0;
             {
-                downloaded_file.write(response.filechunk().data(), response.filechunk().size());
+                std::lock_guard<std::mutex> lock(partial_fetches_mutex);
+                auto partial = partial_fetches.find(filename);
+                if (partial != partial_fetches.end() &&
+                    partial->second.server_mtime == file_status.mtime &&
+                    partial->second.server_size == file_status.size)
+                {
+                    offset = partial->second.offset;
+                    std::cout << "Client Fetch: resuming " << filename << " at byte " << offset << std::endl;
+                }
+                partial_fetches.erase(filename);
             }
 
-            // Check status and return corresponding status
-            Status status = reader->Finish();
-            if (status.ok())
+            std::int64_t received = 0;
+            StatusCode fetch_status;
+            bool striped = offset == 0 && file_status.size >= DFS_STRIPE_THRESHOLD;
+            if (striped)
             {
-                return StatusCode::OK;
+                fetch_status = FetchStriped(filename, fd, file_status.size, &received);
             }
-            else if (status.error_code() == StatusCode::DEADLINE_EXCEEDED)
+            else if (!FetchRangeSync(filename, fd, offset, 0, &received, &fetch_status))
             {
-                return StatusCode::DEADLINE_EXCEEDED;
+                fetch_status = FetchRange(filename, fd, offset, 0, &received);
             }
-            else if (status.error_code() == StatusCode::NOT_FOUND)
+            if (fetch_status == StatusCode::OK)
             {
-                return StatusCode::NOT_FOUND;
+                // drop any tail left over from an older side file
+                if (ftruncate(fd, offset + received) != 0)
+                {
+                    fetch_status = StatusCode::CANCELLED;
+                }
+                close(fd);
+
+                // stripes and resumed ranges are separate reads, a version renamed in between shows up here.
+                // A single stream from the start reads one version and is not read back.
+                if (fetch_status == StatusCode::OK && (striped || offset > 0) &&
+                    dfs_file_checksum(partial_path, &this->crc_table) != static_cast<uint32_t>(file_status.server_crc))
+                {
+                    std::cout << "Client Fetch: " << filename << " changed on the server during the fetch" << std::endl;
+                    fetch_status = StatusCode::CANCELLED;
+                }
+                if (fetch_status == StatusCode::OK && rename(partial_path.c_str(), WrapPath(filename).c_str()) != 0)
+                {
+                    fetch_status = StatusCode::CANCELLED;
+                }
+                if (fetch_status != StatusCode::OK)
+                {
+                    std::remove(partial_path.c_str());
+                }
+                return fetch_status;
+            }
+
+            close(fd);
+            if (offset + received > 0)
+            {
+                std::lock_guard<std::mutex> lock(partial_fetches_mutex);
+                partial_fetches[filename] = {file_status.mtime, file_status.size, offset + received};
             }
             else
             {
-                return StatusCode::CANCELLED;
+                std::remove(partial_path.c_str());
             }
+            return fetch_status;
         }
         else
         { // no diff in files
@@ -324,14 +1601,25 @@ grpc::StatusCode DFSClientNodeP2::Delete(const std::string &filename)
         DeleteRequest request;
         request.set_filename(filename);
 
-        // Set deadline
-        ClientContext context;
-        auto deadline = std::chrono::system_clock::now() +
-                        std::chrono::milliseconds(deadline_timeout);
-        context.set_deadline(deadline);
+        Status status;
+        SyncRequest command;
+        *command.mutable_remove() = request;
+        StatusCode sync_code;
+        if (SyncCall(&command, nullptr, &sync_code))
+        {
+            status = Status(sync_code, "");
+        }
+        else
+        {
+            // Set deadline
+            ClientContext context;
+            auto deadline = std::chrono::system_clock::now() +
+                            std::chrono::milliseconds(deadline_timeout);
+            context.set_deadline(deadline);
 
-        DeleteResponse response;
-        Status status = service_stub->DFSDeleteFile(&context, request, &response);
+            DeleteResponse response;
+            status = service_stub->DFSDeleteFile(&context, request, &response);
+        }
 
         // Check status and return corresponding status
         if (status.ok())
@@ -384,14 +1672,27 @@ grpc::StatusCode DFSClientNodeP2::List(std::map<std::string, int> *file_map, boo
 {
     ListRequest request;
 
-    // Set deadline
-    ClientContext context;
-    auto deadline = std::chrono::system_clock::now() +
-                    std::chrono::milliseconds(deadline_timeout);
-    context.set_deadline(deadline);
-
     ListResponse response;
-    Status status = service_stub->DFSList(&context, request, &response);
+    Status status;
+    SyncRequest command;
+    *command.mutable_list() = request;
+    StatusCode sync_code;
+    if (SyncCall(&command, [&](SyncResponse &reply)
+                 { response.Swap(reply.mutable_list()); return true; },
+                 &sync_code))
+    {
+        status = Status(sync_code, "");
+    }
+    else
+    {
+        // Set deadline
+        ClientContext context;
+        auto deadline = std::chrono::system_clock::now() +
+                        std::chrono::milliseconds(deadline_timeout);
+        context.set_deadline(deadline);
+
+        status = service_stub->DFSList(&context, request, &response);
+    }
 
     if (status.ok())
     {
@@ -442,14 +1743,27 @@ grpc::StatusCode DFSClientNodeP2::Stat(const std::string &filename, void *file_s
     StatusRequest request;
     request.set_filename(filename);
 
-    // Set deadline
-    ClientContext context;
-    auto deadline = std::chrono::system_clock::now() +
-                    std::chrono::milliseconds(deadline_timeout);
-    context.set_deadline(deadline);
-
     StatusResponse response;
-    Status status = service_stub->DFSStatus(&context, request, &response);
+    Status status;
+    SyncRequest command;
+    *command.mutable_stat() = request;
+    StatusCode sync_code;
+    if (SyncCall(&command, [&](SyncResponse &reply)
+                 { response.Swap(reply.mutable_stat()); return true; },
+                 &sync_code))
+    {
+        status = Status(sync_code, "");
+    }
+    else
+    {
+        // Set deadline
+        ClientContext context;
+        auto deadline = std::chrono::system_clock::now() +
+                        std::chrono::milliseconds(deadline_timeout);
+        context.set_deadline(deadline);
+
+        status = service_stub->DFSStatus(&context, request, &response);
+    }
 
     if (status.ok())
     {
@@ -460,6 +1774,8 @@ grpc::StatusCode DFSClientNodeP2::Stat(const std::string &filename, void *file_s
         status->mtime = response.mtime();
         status->ctime = response.ctime();
         status->server_crc = response.crc();
+        status->inlined = response.inlined();
+        status->content = std::move(*response.mutable_content());
 
         // std::cout << "filename: " << response.filename() << std::endl;
         // std::cout << "size: " << response.size() << std::endl;
@@ -532,6 +1848,9 @@ void DFSClientNodeP2::HandleCallbackList()
 
     bool ok = false;
 
+    // nothing is fetched yet, so every staged download is from an earlier run
+    RemoveStaleFetches();
+
     while (completion_queue.Next(&tag, &ok))
     {
         {
@@ -550,6 +1869,8 @@ void DFSClientNodeP2::HandleCallbackList()
             {
 
                 dfs_log(LL_DEBUG3) << "Handling async callback ";
+                std::vector<std::string> stale;
+                std::vector<std::string> changed;
                 for (const auto &info : call_data->reply.fileinfo())
                 {
                     // compute client file stat
@@ -560,21 +1881,71 @@ void DFSClientNodeP2::HandleCallbackList()
                         // larger mtime is more recent
                         if (filestat.st_mtime > info.mtime())
                         { // client has more recent mtime
+                            if (info.has_crc() &&
+                                dfs_file_checksum(WrapPath(filename), &this->crc_table) == static_cast<uint32_t>(info.crc()))
+                            { // touched but not changed
+                                struct utimbuf recent;
+                                recent.actime = filestat.st_atime;
+                                recent.modtime = info.mtime();
+                                utime(WrapPath(filename).c_str(), &recent);
+                                continue;
+                            }
                             std::cout << "Storing existing file to server: " << filename << std::endl;
-                            Store(filename);
+                            changed.push_back(filename);
                         }
                         else if (filestat.st_mtime < info.mtime())
                         { // server has more recent mtime
                             std::cout << "Fetching existing file from server: " << filename << std::endl;
-                            Fetch(filename);
+                            if (filestat.st_size >= DFS_DELTA_MIN_FILE)
+                            {
+                                Fetch(filename);
+                            }
+                            else
+                            {
+                                stale.push_back(filename);
+                            }
                         }
                     }
                     else
                     {
                         // Server has a file that client don't
                         std::cout << "Fetching new file from server: " << filename << std::endl;
-                        Fetch(filename);
+                        stale.push_back(filename);
+                    }
+                }
+
+                // many stale files share a stream instead of a Stat and a stream each
+                if (stale.size() >= DFS_FETCH_BATCH_MIN)
+                {
+                    std::vector<std::string> unfinished;
+                    for (std::size_t first = 0; first < stale.size(); first += DFS_FETCH_BATCH_FILES)
+                    {
+                        std::size_t last = std::min<std::size_t>(first + DFS_FETCH_BATCH_FILES, stale.size());
+                        std::vector<std::string> batch(stale.begin() + first, stale.begin() + last);
+                        FetchBatch(batch, &unfinished);
+                    }
+                    stale.swap(unfinished);
+                }
+                for (const std::string &filename : stale)
+                {
+                    Fetch(filename);
+                }
+
+                // a burst of local changes shares a stream and a single group of locks
+                if (changed.size() >= DFS_STORE_BATCH_MIN)
+                {
+                    std::vector<std::string> unfinished;
+                    for (std::size_t first = 0; first < changed.size(); first += DFS_STORE_BATCH_FILES)
+                    {
+                        std::size_t last = std::min<std::size_t>(first + DFS_STORE_BATCH_FILES, changed.size());
+                        std::vector<std::string> batch(changed.begin() + first, changed.begin() + last);
+                        StoreBatch(batch, &unfinished);
                     }
+                    changed.swap(unfinished);
+                }
+                for (const std::string &filename : changed)
+                {
+                    Store(filename);
                 }
             }
             else
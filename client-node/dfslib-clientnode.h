@@ -4,22 +4,152 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <cstdint>
 #include <limits.h>
 #include <chrono>
 #include <mutex>
+#include <memory>
+#include <thread>
+#include <deque>
+#include <functional>
+#include <condition_variable>
 
 #include <grpcpp/grpcpp.h>
 
 // #include "src/dfslibx-clientnode-p2.h"
 #include "../service/dfs-service.grpc.pb.h"
 
+/** Files at least this large are fetched over several concurrent streams **/
+#ifndef DFS_STRIPE_THRESHOLD
+#define DFS_STRIPE_THRESHOLD (64 * 1024 * 1024)
+#endif
+
+/** Number of concurrent streams used for a striped fetch **/
+#ifndef DFS_STRIPE_COUNT
+#define DFS_STRIPE_COUNT 4
+#endif
+
+/** Files at least this large are uploaded as a delta when the server has a copy **/
+#ifndef DFS_DELTA_MIN_FILE
+#define DFS_DELTA_MIN_FILE (64 * 1024)
+#endif
+
+/**
+ * Compression level of the file chunks sent to the server. Chunks coming back
+ * are compressed at the level the server is configured with.
+ * DFS_COMPRESSION_LEVEL_ENV overrides it when the node is created.
+ */
+#ifndef DFS_CLIENT_COMPRESSION_LEVEL
+#define DFS_CLIENT_COMPRESSION_LEVEL GRPC_COMPRESS_LEVEL_NONE
+#endif
+
+/** Stale files fetched over a single DFSGetFiles stream once at least this many are pending **/
+#ifndef DFS_FETCH_BATCH_MIN
+#define DFS_FETCH_BATCH_MIN 4
+#endif
+
+/** Most files requested in a single DFSGetFiles call **/
+#ifndef DFS_FETCH_BATCH_FILES
+#define DFS_FETCH_BATCH_FILES 64
+#endif
+
+/** Changed files stored over a single DFSStoreFiles stream once at least this many are pending **/
+#ifndef DFS_STORE_BATCH_MIN
+#define DFS_STORE_BATCH_MIN 4
+#endif
+
+/** Most files sent in a single DFSStoreFiles call **/
+#ifndef DFS_STORE_BATCH_FILES
+#define DFS_STORE_BATCH_FILES 64
+#endif
+
+/**
+ * One DFSSync stream shared by every call of a client node.
+ *
+ * Commands are tagged with an id and can be outstanding from several
+ * threads at once. A reader thread hands each response to the command
+ * waiting for it, and change notices to the notice handler.
+ */
+class DFSSyncSession
+{
+
+public:
+    /** Called with each response of a command, returns false to stop receiving it **/
+    typedef std::function<bool(dfs_service::SyncResponse &)> Handler;
+
+    /** Called on the reader thread with each change notice pushed by the server **/
+    typedef std::function<void(const dfs_service::ListResponse::FileInfo &)> NoticeHandler;
+
+    DFSSyncSession(dfs_service::DFSService::Stub *stub, const std::string &cid, NoticeHandler on_notice);
+    ~DFSSyncSession();
+
+    /**
+     * Whether the stream is still up
+     *
+     * @return bool
+     */
+    bool Ok();
+
+    /**
+     * Send a command and wait until its last response has been handled
+     *
+     * @param request the command, its id is assigned here
+     * @param timeout_ms
+     * @param handler
+     * @return the status code of the command, DEADLINE_EXCEEDED when it timed out,
+     *         UNAVAILABLE when the stream broke and the call should be made directly
+     */
+    grpc::StatusCode Call(dfs_service::SyncRequest *request, int timeout_ms, Handler handler);
+
+private:
+    /** A command waiting for its responses **/
+    struct Pending
+    {
+        Handler handler;
+        bool done = false;
+        bool in_handler = false;
+        grpc::StatusCode code = grpc::StatusCode::OK;
+    };
+
+    void ReadLoop();
+
+    std::string cid;
+    NoticeHandler on_notice;
+
+    grpc::ClientContext context;
+    std::unique_ptr<grpc::ClientReaderWriter<dfs_service::SyncRequest, dfs_service::SyncResponse>> stream;
+
+    /** Mutex for writing to the stream and the two flags below **/
+    std::mutex write_mutex;
+
+    /** The first message, which carries the cid, has been sent **/
+    bool cid_sent = false;
+
+    /** Finish was called, nothing more may be written **/
+    bool stream_finished = false;
+
+    /** Mutex for the pending commands **/
+    std::mutex mutex;
+    std::condition_variable done_cv;
+    std::unordered_map<std::uint64_t, std::shared_ptr<Pending>> pending;
+    std::uint64_t next_id = 1;
+
+    /** The stream has ended **/
+    bool broken = false;
+
+    std::thread reader;
+};
+
 struct FileStatus
 {
     std::string filename;
-    int size;
+    std::int64_t size;
     int mtime;
     int ctime;
     int server_crc;
+    bool inlined;
+    std::string content;
 };
 
 class DFSClientNodeP2 : public DFSClientNode
@@ -36,6 +166,23 @@ public:
      */
     ~DFSClientNodeP2();
 
+    /**
+     * Store several files over a single DFSStoreFiles stream, taking their
+     * write locks as a group. Meant for bursts of changes to the mount.
+     *
+     * @param filenames
+     * @param unfinished set to the files that should be retried one by one with Store
+     * @return grpc::StatusCode
+     */
+    grpc::StatusCode StoreBatch(const std::vector<std::string> &filenames, std::vector<std::string> *unfinished);
+
+    /**
+     * Set the compression level of the file chunks sent to the server
+     *
+     * @param level
+     */
+    void SetCompressionLevel(grpc_compression_level level);
+
     /**
      * Request write access to the server
      *
@@ -137,7 +284,221 @@ public:
     void InotifyWatcherCallback(std::function<void()> callback) override;
 
 private:
+    /** Progress of a fetch that was interrupted part way through, kept in its side file **/
+    struct PartialFetch
+    {
+        int server_mtime;
+        std::int64_t server_size;
+        std::int64_t offset;
+    };
+
+    /** An upload the server can continue after an interruption **/
+    struct UploadSession
+    {
+        std::string session_id;
+        off_t local_size;
+        time_t local_mtime;
+    };
+
+    /**
+     * The shared DFSSync session, reopened when it broke
+     *
+     * @return the session, or nullptr while the server did not take one
+     */
+    std::shared_ptr<DFSSyncSession> SyncSession();
+
+    /**
+     * Run a command over the DFSSync session
+     *
+     * @param request
+     * @param handler
+     * @param code set to the status code of the command
+     * @return false if there is no session and the call should be made directly
+     */
+    bool SyncCall(dfs_service::SyncRequest *request, DFSSyncSession::Handler handler, grpc::StatusCode *code);
+
+    /**
+     * Fetch a byte range over the DFSSync session, see FetchRange
+     *
+     * @param filename
+     * @param fd
+     * @param offset
+     * @param length
+     * @param received
+     * @param code set to the status code of the fetch
+     * @return false if there is no session and FetchRange should be used
+     */
+    bool FetchRangeSync(const std::string &filename, int fd, std::int64_t offset, std::int64_t length,
+                        std::int64_t *received, grpc::StatusCode *code);
+
+    /**
+     * Whether a file is a download staged in the mount, which is never stored
+     *
+     * @param filename
+     * @return
+     */
+    static bool IsFetchTempFile(const std::string &filename);
+
+    /**
+     * Remove the staged downloads a previous run left in the mount
+     */
+    void RemoveStaleFetches();
+
+    /**
+     * Path of the side file a full fetch is written to and resumed from
+     *
+     * @param filename
+     * @return
+     */
+    std::string PartialPath(const std::string &filename);
+
+    /**
+     * Forget an interrupted fetch and remove its side file
+     *
+     * @param filename
+     */
+    void DropPartialFetch(const std::string &filename);
+
+    /**
+     * Queue a change notice pushed over the DFSSync session
+     *
+     * @param notice
+     */
+    void QueueSyncNotice(const dfs_service::ListResponse::FileInfo &notice);
+
+    /**
+     * Fetch the files named in change notices until the client node shuts down
+     */
+    void HandleSyncNotices();
+
+    /**
+     * Compress the messages the client sends on this call at the configured
+     * level, unless the sampled start of the file looks incompressible
+     *
+     * @param context
+     * @param sample the start of the file being sent
+     * @param sample_size
+     */
+    void SetCallCompression(grpc::ClientContext *context, const char *sample, std::size_t sample_size);
+
+    /**
+     * Open a new upload session on the RPC server, or resume an existing one
+     *
+     * @param filename
+     * @param resume_id the session to resume, empty to open a new one
+     * @param session_id set to the session the upload continues in
+     * @param offset set to the number of bytes the server already holds
+     * @return grpc::StatusCode
+     */
+    grpc::StatusCode OpenUpload(const std::string &filename, const std::string &resume_id,
+                                std::string *session_id, std::int64_t *offset);
+
+    /**
+     * Upload only the blocks of a file that differ from the copy on the RPC server
+     *
+     * @param filename
+     * @param client_crc the crc of the local file
+     * @return grpc::StatusCode, FAILED_PRECONDITION when the file should be sent in full
+     */
+    grpc::StatusCode StoreDelta(const std::string &filename, std::uint32_t client_crc);
+
+    /**
+     * Bring a small file up to date from the content the server inlined
+     * in a status response or change notice, without a DFSGetFile call
+     *
+     * @param filename
+     * @param content the whole file as sent by the server
+     * @param server_crc
+     * @param server_mtime
+     * @return grpc::StatusCode, ALREADY_EXISTS when the local copy is identical
+     */
+    grpc::StatusCode FetchInlined(const std::string &filename, const std::string &content,
+                                  std::uint32_t server_crc, int server_mtime);
+
+    /**
+     * Fetch several whole files over a single DFSGetFiles stream
+     *
+     * @param filenames
+     * @param unfinished set to the files that were not written, to be fetched one by one
+     * @return grpc::StatusCode
+     */
+    grpc::StatusCode FetchBatch(const std::vector<std::string> &filenames, std::vector<std::string> *unfinished);
+
+    /**
+     * Fetch only the blocks of a file that differ from the stale local copy
+     *
+     * @param filename
+     * @param server_crc the crc the server reported for its copy
+     * @return grpc::StatusCode, FAILED_PRECONDITION when the file should be fetched in full
+     */
+    grpc::StatusCode FetchDelta(const std::string &filename, std::uint32_t server_crc);
+
+    /**
+     * Fetch a byte range of a file from the RPC server and write it
+     * to the file descriptor at the same offset
+     *
+     * @param filename
+     * @param fd
+     * @param offset
+     * @param length 0 fetches through to the end of the file
+     * @param received set to the number of bytes written, even on failure
+     * @return grpc::StatusCode
+     */
+    grpc::StatusCode FetchRange(const std::string &filename, int fd,
+                                std::int64_t offset, std::int64_t length,
+                                std::int64_t *received);
+
+    /**
+     * Fetch a whole file by splitting it into DFS_STRIPE_COUNT ranges
+     * that are fetched concurrently on separate streams
+     *
+     * @param filename
+     * @param fd
+     * @param size the file size reported by the server
+     * @param received set to the contiguous number of bytes written from the start of the file
+     * @return grpc::StatusCode
+     */
+    grpc::StatusCode FetchStriped(const std::string &filename, int fd,
+                                  std::int64_t size, std::int64_t *received);
+
+    /** Compression level of the file chunks sent to the server **/
+    grpc_compression_level compression_level = DFS_CLIENT_COMPRESSION_LEVEL;
+
+    /** Mutex for the sync session and its retry time **/
+    std::mutex sync_session_mutex;
+
+    /** The DFSSync stream shared by the calls below **/
+    std::shared_ptr<DFSSyncSession> sync_session;
+
+    /** No new session is opened before this time after one broke **/
+    std::chrono::steady_clock::time_point sync_retry_at;
+
+    /** Mutex for the change notices and the stop flag **/
+    std::mutex sync_notices_mutex;
+    std::condition_variable sync_notices_cv;
+
+    /** Change notices waiting to be fetched **/
+    std::deque<dfs_service::ListResponse::FileInfo> sync_notices;
+
+    /** Set when the client node shuts down **/
+    bool sync_stopping = false;
+
+    /** Runs HandleSyncNotices once a session is open **/
+    std::thread sync_notice_thread;
+
     /** Mutex for watcher and handle threads **/
     std::mutex watcher_handle_mutex;
+
+    /** Mutex for the partial fetches map **/
+    std::mutex partial_fetches_mutex;
+
+    /** Interrupted fetches that can be resumed, keyed by filename **/
+    std::unordered_map<std::string, PartialFetch> partial_fetches;
+
+    /** Mutex for the upload sessions map **/
+    std::mutex upload_sessions_mutex;
+
+    /** Interrupted uploads that can be resumed, keyed by filename **/
+    std::unordered_map<std::string, UploadSession> upload_sessions;
 };
 #endif
@@ -1,17 +1,36 @@
 #include <map>
+#include <list>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
 #include <mutex>
 #include <shared_mutex>
 #include <chrono>
 #include <cstdio>
+#include <cstring>
 #include <string>
 #include <thread>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <deque>
+#include <random>
+#include <iomanip>
+#include <functional>
 #include <iostream>
 #include <fstream>
 #include <getopt.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/xattr.h>
+#include <poll.h>
 #include <grpcpp/grpcpp.h>
+#include <grpcpp/support/message_allocator.h>
 
 #include "../service/dfs-service.grpc.pb.h"
 // #include "src/dfslibx-call-data.h"
@@ -19,11 +38,11 @@
 #include "../shared/dfslib-shared.h"
 #include "dfslib-servernode.h"
 
+using grpc::CallbackServerContext;
 using grpc::Server;
 using grpc::ServerBuilder;
 using grpc::ServerContext;
-using grpc::ServerReader;
-using grpc::ServerWriter;
+using grpc::ServerUnaryReactor;
 using grpc::Status;
 using grpc::StatusCode;
 
@@ -32,60 +51,3146 @@ using dfs_service::DeleteResponse;
 using dfs_service::DFSService;
 using dfs_service::GetRequest;
 using dfs_service::GetResponse;
+using dfs_service::GetFilesRequest;
+using dfs_service::GetFilesResponse;
 using dfs_service::ListRequest;
 using dfs_service::ListResponse;
 using dfs_service::LockRequest;
 using dfs_service::LockResponse;
 using dfs_service::StatusRequest;
+using dfs_service::SignatureRequest;
+using dfs_service::SignatureResponse;
 using dfs_service::StatusResponse;
 using dfs_service::StoreRequest;
 using dfs_service::StoreResponse;
+using dfs_service::StoreFilesRequest;
+using dfs_service::StoreFilesResponse;
+using dfs_service::SyncRequest;
+using dfs_service::SyncResponse;
+using dfs_service::UploadRequest;
+using dfs_service::UploadResponse;
 
 using FileRequestType = ListRequest;
 using FileListResponseType = ListResponse;
 
 extern dfs_log_level_e DFS_LOG_LEVEL;
 
-class DFSServiceImpl final : public DFSService::WithAsyncMethod_CallbackList<DFSService::Service>,
+/**
+ * Batches the flushes of concurrent uploads into a single syncfs.
+ *
+ * The first upload to ask becomes the leader: it waits out the commit
+ * window so other uploads can join, flushes the filesystem once and
+ * wakes everyone who joined the batch.
+ */
+class DFSGroupCommit
+{
+
+private:
+    /** An upload waiting for its batch to be flushed **/
+    struct Waiter
+    {
+        bool done = false;
+        bool ok = false;
+    };
+
+    /** Mutex for the pending batch **/
+    std::mutex mutex;
+
+    /** Signalled when a batch has been flushed **/
+    std::condition_variable flushed;
+
+    /** Whether a leader is currently collecting or flushing a batch **/
+    bool flushing = false;
+
+    /** Uploads waiting for the next flush **/
+    std::vector<Waiter *> pending;
+
+public:
+    /**
+     * Block until the data written through fd is on stable storage
+     *
+     * @param fd
+     * @return false if the flush failed
+     */
+    bool Sync(FileDescriptor fd)
+    {
+        Waiter self;
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->pending.push_back(&self);
+        while (!self.done)
+        {
+            if (this->flushing)
+            {
+                this->flushed.wait(lock);
+                continue;
+            }
+
+            // lead the next batch
+            this->flushing = true;
+            lock.unlock();
+            std::this_thread::sleep_for(std::chrono::milliseconds(DFS_GROUP_COMMIT_WINDOW_MS));
+            lock.lock();
+            std::vector<Waiter *> batch;
+            batch.swap(this->pending);
+            lock.unlock();
+
+            bool ok = syncfs(fd) == 0;
+
+            lock.lock();
+            for (Waiter *waiter : batch)
+            {
+                waiter->done = true;
+                waiter->ok = ok;
+            }
+            this->flushing = false;
+            this->flushed.notify_all();
+        }
+        return self.ok;
+    }
+};
+
+/**
+ * A fixed set of threads that run the blocking disk work of every RPC.
+ *
+ * The gRPC callback threads only post work here, so they never wait on
+ * the disk and the number of threads stays fixed however many streams
+ * are open.
+ */
+class DFSWorkerPool
+{
+
+private:
+    /** Mutex for the task queue **/
+    std::mutex mutex;
+
+    /** Signalled when a task is queued or the pool stops **/
+    std::condition_variable ready;
+
+    /** Tasks waiting for a thread **/
+    std::deque<std::function<void()>> tasks;
+
+    /** Set when the pool is being destroyed **/
+    bool stopping = false;
+
+    /** The worker threads **/
+    std::vector<std::thread> threads;
+
+    void Run()
+    {
+        while (true)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(this->mutex);
+                this->ready.wait(lock, [this]
+                                 { return !this->tasks.empty() || this->stopping; });
+                if (this->tasks.empty())
+                {
+                    return;
+                }
+                task = std::move(this->tasks.front());
+                this->tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+public:
+    explicit DFSWorkerPool(int num_threads)
+    {
+        for (int i = 0; i < num_threads; i++)
+        {
+            this->threads.emplace_back(&DFSWorkerPool::Run, this);
+        }
+    }
+
+    /**
+     * Finish the queued tasks and stop the threads
+     */
+    ~DFSWorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->stopping = true;
+            this->ready.notify_all();
+        }
+        for (std::thread &thread : this->threads)
+        {
+            thread.join();
+        }
+    }
+
+    /**
+     * Queue a task to run on one of the pool threads
+     *
+     * @param task
+     */
+    void Post(std::function<void()> task)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->tasks.push_back(std::move(task));
+        this->ready.notify_one();
+    }
+};
+
+/**
+ * A memory-bounded LRU cache of file blocks.
+ *
+ * Blocks are DFS_CHUNK_SIZE bytes and keyed by inode, mtime and block
+ * index, so a modified or replaced file is never served stale. Invalidate
+ * releases the blocks of a replaced or deleted file straight away.
+ */
+class DFSBlockCache
+{
+
+public:
+    struct Key
+    {
+        ino_t inode;
+        std::int64_t mtime_ns;
+        std::size_t block;
+
+        bool operator==(const Key &other) const
+        {
+            return inode == other.inode && mtime_ns == other.mtime_ns && block == other.block;
+        }
+    };
+
+    /**
+     * Build the key of a block of a file
+     *
+     * @param filestat
+     * @param block
+     * @return
+     */
+    static Key MakeKey(const struct stat &filestat, std::size_t block)
+    {
+        return {filestat.st_ino,
+                static_cast<std::int64_t>(filestat.st_mtim.tv_sec) * 1000000000 + filestat.st_mtim.tv_nsec,
+                block};
+    }
+
+    explicit DFSBlockCache(std::size_t capacity) : capacity(capacity) {}
+
+    /**
+     * Look up a block, marking it most recently used
+     *
+     * @param key
+     * @return the block, or nullptr on a miss
+     */
+    std::shared_ptr<const std::string> Get(const Key &key)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        auto found = this->index.find(key);
+        if (found == this->index.end())
+        {
+            this->misses++;
+            return nullptr;
+        }
+        this->hits++;
+        this->lru.splice(this->lru.begin(), this->lru, found->second);
+        return found->second->second;
+    }
+
+    /**
+     * Insert a block, evicting the least recently used ones over the cap
+     *
+     * @param key
+     * @param block
+     */
+    void Put(const Key &key, std::shared_ptr<const std::string> block)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (block->size() > this->capacity || this->index.count(key) > 0)
+        {
+            return;
+        }
+        this->used += block->size();
+        this->lru.emplace_front(key, std::move(block));
+        this->index[key] = this->lru.begin();
+        while (this->used > this->capacity)
+        {
+            Evict(std::prev(this->lru.end()));
+        }
+    }
+
+    /**
+     * Drop every cached block of a file
+     *
+     * @param inode
+     */
+    void Invalidate(ino_t inode)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        for (auto entry = this->lru.begin(); entry != this->lru.end();)
+        {
+            auto next = std::next(entry);
+            if (entry->first.inode == inode)
+            {
+                Evict(entry);
+            }
+            entry = next;
+        }
+    }
+
+    std::uint64_t Hits() const { return this->hits; }
+    std::uint64_t Misses() const { return this->misses; }
+
+private:
+    struct KeyHash
+    {
+        std::size_t operator()(const Key &key) const
+        {
+            std::size_t hash = std::hash<ino_t>()(key.inode);
+            hash = hash * 31 + std::hash<std::int64_t>()(key.mtime_ns);
+            return hash * 31 + std::hash<std::size_t>()(key.block);
+        }
+    };
+
+    using Entry = std::pair<Key, std::shared_ptr<const std::string>>;
+
+    void Evict(std::list<Entry>::iterator entry)
+    {
+        this->used -= entry->second->size();
+        this->index.erase(entry->first);
+        this->lru.erase(entry);
+    }
+
+    /** Mutex for the list and index **/
+    std::mutex mutex;
+
+    /** Blocks ordered from most to least recently used **/
+    std::list<Entry> lru;
+
+    /** Lookup from key to position in the list **/
+    std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+
+    /** Maximum number of cached bytes **/
+    std::size_t capacity;
+
+    /** Number of cached bytes **/
+    std::size_t used = 0;
+
+    std::atomic<std::uint64_t> hits{0};
+    std::atomic<std::uint64_t> misses{0};
+};
+
+/**
+ * Gives each unary call its own protobuf arena for the request and response.
+ *
+ * Every message the handler adds, such as one FileInfo per listed file, is
+ * carved out of the arena blocks and the whole call is freed at once when
+ * gRPC releases the messages.
+ */
+template <typename Request, typename Response>
+class DFSArenaAllocator : public grpc::MessageAllocator<Request, Response>
+{
+
+private:
+    class Holder : public grpc::MessageHolder<Request, Response>
+    {
+
+    private:
+        google::protobuf::Arena arena;
+
+    public:
+        explicit Holder(const google::protobuf::ArenaOptions &options) : arena(options)
+        {
+            this->set_request(google::protobuf::Arena::CreateMessage<Request>(&this->arena));
+            this->set_response(google::protobuf::Arena::CreateMessage<Response>(&this->arena));
+        }
+
+        void Release() override
+        {
+            dfs_log(LL_DEBUG3) << "Releasing arena of " << this->arena.SpaceUsed() << " bytes";
+            delete this;
+        }
+    };
+
+    google::protobuf::ArenaOptions options;
+
+public:
+    DFSArenaAllocator(std::size_t start_block_size, std::size_t max_block_size)
+    {
+        this->options.start_block_size = start_block_size;
+        this->options.max_block_size = max_block_size;
+    }
+
+    grpc::MessageHolder<Request, Response> *AllocateMessages() override
+    {
+        return new Holder(this->options);
+    }
+};
+
+/**
+ * CallbackList keeps the completion queue runner, every other RPC
+ * uses the callback API.
+ */
+using DFSCallbackService = DFSService::WithCallbackMethod_DFSStoreFile<
+    DFSService::WithCallbackMethod_DFSStoreFiles<
+        DFSService::WithCallbackMethod_DFSOpenUpload<
+            DFSService::WithCallbackMethod_DFSGetSignatures<
+                DFSService::WithCallbackMethod_DFSGetFile<
+                    DFSService::WithCallbackMethod_DFSGetFiles<
+                        DFSService::WithCallbackMethod_DFSList<
+                            DFSService::WithCallbackMethod_DFSStatus<
+                                DFSService::WithCallbackMethod_DFSRequestLock<
+                                    DFSService::WithCallbackMethod_DFSDeleteFile<
+                                        DFSService::WithCallbackMethod_DFSSync<
+                                            DFSService::WithAsyncMethod_CallbackList<DFSService::Service>>>>>>>>>>>>;
+
+class DFSServiceImpl final : public DFSCallbackService,
                              public DFSCallDataManager<FileRequestType, FileListResponseType>
 {
 
-private:
-    /** The runner service used to start the service and manage asynchronicity **/
-    DFSServiceRunner<FileRequestType, FileListResponseType> runner;
+private:
+    /** The runner service used to start the service and manage asynchronicity **/
+    DFSServiceRunner<FileRequestType, FileListResponseType> runner;
+
+    /** The mount path for the server **/
+    std::string mount_path;
+
+    /** Mutex for managing the queue requests **/
+    std::mutex queue_mutex;
+
+    /** Mutex for write locks map **/
+    std::mutex write_locks_mutex;
+
+    /** Map for server to track which client holds lock **/
+    std::unordered_map<std::string, std::string> write_locks;
+
+    /** Files a DFSStoreFile or DFSStoreFiles stream is writing, guarded by write_locks_mutex **/
+    std::unordered_map<std::string, int> open_stores;
+
+    /**
+     * Count a stream writing a file, or one less. Caller holds write_locks_mutex.
+     *
+     * @param filename
+     * @param delta
+     */
+    void CountOpenStore(const std::string &filename, int delta)
+    {
+        int &count = this->open_stores[filename];
+        count += delta;
+        if (count <= 0)
+        {
+            this->open_stores.erase(filename);
+        }
+    }
+
+    /** The vector of queued tags used to manage asynchronous requests **/
+    std::vector<QueueRequest<FileRequestType, FileListResponseType>> queued_tags;
+
+    /** Batches upload flushes under the DFS_SYNC_GROUP policy **/
+    DFSGroupCommit group_commit;
+
+    /** Blocks of recently fetched files **/
+    DFSBlockCache block_cache;
+
+    /** Mutex for the blob store, held while blob links are added or removed **/
+    std::mutex blob_mutex;
+
+    /** Checksum of every stored blob keyed by inode, shared by all names linked to it **/
+    std::unordered_map<ino_t, std::uint32_t> blob_index;
+
+    /** Commit time of a name linked to a blob it shares, whose inode keeps the time of the first copy **/
+    struct NameTime
+    {
+        ino_t inode;
+        std::int64_t mtime_ns;
+    };
+
+    /** Commit times of the names that share a blob, guarded by blob_mutex **/
+    std::unordered_map<std::string, NameTime> name_times;
+
+    /** The name times journal, appended to on every shared commit **/
+    FileDescriptor name_times_fd = -1;
+
+    /** What is known about a stored file without going to the disk **/
+    struct FileMetadata
+    {
+        ino_t inode = 0;
+        std::int64_t size = 0;
+        std::int64_t mtime_ns = 0;
+        time_t mtime = 0;
+        time_t ctime = 0;
+
+        /** Checksum of the content, computed on the first DFSStatus that needs it **/
+        std::uint32_t crc = 0;
+        bool has_crc = false;
+
+        /** Changes whenever the content does, so a checksum is only stored against the version it was read from **/
+        std::uint64_t version = 0;
+    };
+
+    /** Mutex for the metadata table **/
+    std::shared_mutex metadata_mutex;
+
+    /** Every stored file keyed by name, answers DFSList, DFSStatus and CallbackList **/
+    std::unordered_map<std::string, FileMetadata> metadata;
+
+    /** Last version handed out, guarded by metadata_mutex **/
+    std::uint64_t metadata_version = 0;
+
+    /** inotify instance watching the mount path for changes made behind the server's back **/
+    int watch_fd = -1;
+
+    /** Signalled to stop the watch thread **/
+    int watch_stop_fd = -1;
+
+    std::thread watch_thread;
+
+    /** An upload that a later DFSStoreFile stream can continue **/
+    struct UploadSession
+    {
+        std::string filename;
+        std::string cid;
+        std::string temp_path;
+
+        /** Bytes of the temp file that are on stable storage **/
+        std::int64_t committed = 0;
+
+        /** A stream is currently writing to the session **/
+        bool attached = false;
+
+        std::chrono::steady_clock::time_point touched;
+    };
+
+    class SyncReactor;
+
+    /** Mutex for the open sync sessions, taken before a session's own mutex **/
+    std::mutex sync_sessions_mutex;
+
+    /** Open DFSSync sessions that get change notices **/
+    std::unordered_set<SyncReactor *> sync_sessions;
+
+    /** Mutex for the upload sessions map, taken before write_locks_mutex **/
+    std::mutex upload_sessions_mutex;
+
+    /** Open upload sessions keyed by session id **/
+    std::unordered_map<std::string, UploadSession> upload_sessions;
+
+    /**
+     * Drop sessions that have not been resumed within DFS_UPLOAD_SESSION_TTL_MS,
+     * releasing the write locks they held. Caller holds upload_sessions_mutex.
+     */
+    void ExpireUploadSessions()
+    {
+        auto now = std::chrono::steady_clock::now();
+        for (auto session = this->upload_sessions.begin(); session != this->upload_sessions.end();)
+        {
+            if (!session->second.attached &&
+                now - session->second.touched > std::chrono::milliseconds(DFS_UPLOAD_SESSION_TTL_MS))
+            {
+                dfs_log(LL_SYSINFO) << "Expiring upload session for " << session->second.filename;
+                std::remove(session->second.temp_path.c_str());
+                std::lock_guard<std::mutex> lock(write_locks_mutex);
+                auto holder = write_locks.find(session->second.filename);
+                if (holder != write_locks.end() && holder->second == session->second.cid)
+                {
+                    write_locks.erase(holder);
+                }
+                session = this->upload_sessions.erase(session);
+            }
+            else
+            {
+                ++session;
+            }
+        }
+    }
+
+    /**
+     * Claim an upload session for a stream that continues it at offset.
+     *
+     * @param session_id
+     * @param offset must not be past the committed bytes
+     * @param filename set to the file being uploaded
+     * @param temp_path set to the temp file holding the upload
+     * @return false if the session is unknown, busy or the offset is invalid
+     */
+    bool AttachUploadSession(const std::string &session_id, std::int64_t offset,
+                             std::string *filename, std::string *temp_path)
+    {
+        std::lock_guard<std::mutex> lock(upload_sessions_mutex);
+        auto session = this->upload_sessions.find(session_id);
+        if (session == this->upload_sessions.end() || session->second.attached ||
+            offset < 0 || offset > session->second.committed)
+        {
+            return false;
+        }
+        session->second.attached = true;
+        *filename = session->second.filename;
+        *temp_path = session->second.temp_path;
+        return true;
+    }
+
+    /**
+     * Release an interrupted session so it can be resumed later.
+     *
+     * @param session_id
+     * @param committed bytes of the temp file now on stable storage
+     */
+    void DetachUploadSession(const std::string &session_id, std::int64_t committed)
+    {
+        std::lock_guard<std::mutex> lock(upload_sessions_mutex);
+        auto session = this->upload_sessions.find(session_id);
+        if (session != this->upload_sessions.end())
+        {
+            session->second.attached = false;
+            session->second.committed = committed;
+            session->second.touched = std::chrono::steady_clock::now();
+        }
+    }
+
+    /**
+     * Forget a session that completed or cannot continue.
+     *
+     * @param session_id
+     */
+    void CloseUploadSession(const std::string &session_id)
+    {
+        std::lock_guard<std::mutex> lock(upload_sessions_mutex);
+        auto session = this->upload_sessions.find(session_id);
+        if (session != this->upload_sessions.end())
+        {
+            // gone already when the upload was committed
+            std::remove(session->second.temp_path.c_str());
+            this->upload_sessions.erase(session);
+        }
+    }
+
+    /**
+     * Generate an unguessable upload session id.
+     *
+     * @return
+     */
+    static std::string NewSessionId()
+    {
+        thread_local std::mt19937_64 generator(std::random_device{}());
+        std::ostringstream session_id;
+        session_id << std::hex << std::setfill('0') << std::setw(16) << generator()
+                   << std::setw(16) << generator();
+        return session_id.str();
+    }
+
+    /**
+     * Drop the cached blocks of a file that is about to be replaced or removed.
+     *
+     * @param filename
+     */
+    void InvalidateCachedFile(const std::string &filename)
+    {
+        struct stat filestat;
+        if (stat(WrapPath(filename).c_str(), &filestat) == 0)
+        {
+            this->block_cache.Invalidate(filestat.st_ino);
+        }
+    }
+
+    /**
+     * Prepend the mount path, and the file's shard under DFS_FANOUT, to the filename.
+     *
+     * @param filepath
+     * @return
+     */
+    const std::string WrapPath(const std::string &filepath)
+    {
+        return ShardDir(filepath) + filepath;
+    }
+
+    /**
+     * Directory a stored file lives in.
+     *
+     * @param filename
+     * @return the mount path, or the two-level shard picked by the checksum of the name
+     */
+    std::string ShardDir(const std::string &filename)
+    {
+        if (!DFS_FANOUT)
+        {
+            return this->mount_path;
+        }
+        std::uint32_t crc = CRC::Calculate(filename.data(), filename.size(), this->crc_table);
+        char shard[8];
+        std::snprintf(shard, sizeof(shard), "%02x/%02x/", crc & 0xff, (crc >> 8) & 0xff);
+        return this->mount_path + shard;
+    }
+
+    /**
+     * Template of the temporary file an upload is staged in, always at the top of the mount path.
+     *
+     * @param filename
+     * @return
+     */
+    std::string UploadTemplate(const std::string &filename)
+    {
+        return this->mount_path + DFS_TEMP_PREFIX + filename + ".XXXXXX";
+    }
+
+    /**
+     * Create the shard directories of a file if they do not exist yet.
+     *
+     * @param filename
+     * @return false if a directory could not be created
+     */
+    bool MakeShard(const std::string &filename)
+    {
+        std::string shard = ShardDir(filename);
+        std::string top = shard.substr(0, this->mount_path.size() + 3);
+        std::pair<std::string, std::string> levels[] = {{top, this->mount_path}, {shard, top}};
+        for (const auto &level : levels)
+        {
+            if (mkdir(level.first.c_str(), 0755) == 0)
+            {
+                if (DFS_SYNC_POLICY == DFS_SYNC_FDATASYNC)
+                {
+                    SyncDirectory(level.second);
+                }
+            }
+            else if (errno != EEXIST)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Persist the entries of a directory.
+     *
+     * @param path
+     */
+    static void SyncDirectory(const std::string &path)
+    {
+        FileDescriptor dir_fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd >= 0)
+        {
+            fsync(dir_fd);
+            close(dir_fd);
+        }
+    }
+
+    /**
+     * Whether a directory entry is one level of the fan-out tree
+     *
+     * @param name
+     * @return
+     */
+    static bool IsShardName(const char *name)
+    {
+        return std::isxdigit(static_cast<unsigned char>(name[0])) && std::isxdigit(static_cast<unsigned char>(name[1])) &&
+               name[2] == '\0';
+    }
+
+    /**
+     * Fill the metadata table from the shard directories.
+     *
+     * Files left at the top of the mount path by the flat layout are moved
+     * into their shards first.
+     */
+    void IndexShards()
+    {
+        if (!DFS_FANOUT)
+        {
+            return;
+        }
+        DIR *dir = opendir(mount_path.c_str());
+        if (dir == NULL)
+        {
+            return;
+        }
+        std::vector<std::string> flat;
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            if (entry->d_type == DT_REG && !IsReservedName(entry->d_name))
+            {
+                flat.push_back(entry->d_name);
+            }
+            else if (entry->d_type == DT_DIR && IsShardName(entry->d_name))
+            {
+                IndexShard(std::string(entry->d_name) + "/", 1);
+            }
+        }
+        closedir(dir);
+
+        for (const std::string &filename : flat)
+        {
+            if (MakeShard(filename) && rename((this->mount_path + filename).c_str(), WrapPath(filename).c_str()) == 0)
+            {
+                dfs_log(LL_SYSINFO) << "Moved " << filename << " into its shard";
+                RefreshMetadata(filename);
+            }
+        }
+    }
+
+    /**
+     * Add the files of one shard directory to the metadata table.
+     *
+     * @param shard path of the shard below the mount path
+     * @param level 1 for the top level, 2 for the directories holding files
+     */
+    void IndexShard(const std::string &shard, int level)
+    {
+        DIR *dir = opendir((this->mount_path + shard).c_str());
+        if (dir == NULL)
+        {
+            return;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            if (level == 2 && entry->d_type == DT_REG)
+            {
+                RefreshMetadata(entry->d_name);
+            }
+            else if (level == 1 && entry->d_type == DT_DIR && IsShardName(entry->d_name))
+            {
+                IndexShard(shard + entry->d_name + "/", 2);
+            }
+        }
+        closedir(dir);
+    }
+
+    /**
+     * Fill the metadata table from the stored files.
+     */
+    void LoadMetadata()
+    {
+        if (DFS_FANOUT)
+        {
+            IndexShards();
+        }
+        else
+        {
+            DIR *dir = opendir(mount_path.c_str());
+            if (dir == NULL)
+            {
+                return;
+            }
+            struct dirent *entry;
+            while ((entry = readdir(dir)) != NULL)
+            {
+                if (entry->d_type == DT_REG && !IsReservedName(entry->d_name))
+                {
+                    RefreshMetadata(entry->d_name);
+                }
+            }
+            closedir(dir);
+        }
+
+        std::shared_lock<std::shared_mutex> lock(this->metadata_mutex);
+        dfs_log(LL_SYSINFO) << "Loaded the metadata of " << this->metadata.size() << " stored files";
+    }
+
+    /**
+     * Bring the metadata of a file in line with the disk.
+     *
+     * The checksum survives as long as the inode, size and mtime do. A new
+     * version takes it from the blob index or the checksum attribute when one
+     * of them has it, so listings carry it without reading the file. A file
+     * that is gone, or is not a regular file, is dropped from the table.
+     *
+     * @param filename
+     */
+    void RefreshMetadata(const std::string &filename)
+    {
+        struct stat filestat;
+        bool stored = stat(WrapPath(filename).c_str(), &filestat) == 0 && S_ISREG(filestat.st_mode);
+        std::uint32_t crc = 0;
+        bool has_crc = stored && BlobChecksum(filestat, &crc);
+        if (has_crc)
+        {
+            ApplyNameTime(filename, &filestat);
+        }
+        else if (stored)
+        {
+            has_crc = SavedChecksum(WrapPath(filename), filestat, &crc);
+        }
+
+        std::unique_lock<std::shared_mutex> lock(this->metadata_mutex);
+        if (!stored)
+        {
+            this->metadata.erase(filename);
+            return;
+        }
+        FileMetadata &entry = this->metadata[filename];
+        std::int64_t mtime_ns = static_cast<std::int64_t>(filestat.st_mtim.tv_sec) * 1000000000 + filestat.st_mtim.tv_nsec;
+        entry.ctime = filestat.st_ctime;
+        if (entry.version != 0 && entry.inode == filestat.st_ino && entry.size == filestat.st_size &&
+            entry.mtime_ns == mtime_ns)
+        {
+            return;
+        }
+        entry.inode = filestat.st_ino;
+        entry.size = filestat.st_size;
+        entry.mtime_ns = mtime_ns;
+        entry.mtime = filestat.st_mtime;
+        entry.crc = crc;
+        entry.has_crc = has_crc;
+        entry.version = ++this->metadata_version;
+    }
+
+    /**
+     * Copy the metadata of a file out of the table.
+     *
+     * @param filename
+     * @param entry
+     * @return false if the file is not stored
+     */
+    bool LookupMetadata(const std::string &filename, FileMetadata *entry)
+    {
+        std::shared_lock<std::shared_mutex> lock(this->metadata_mutex);
+        auto found = this->metadata.find(filename);
+        if (found == this->metadata.end())
+        {
+            return false;
+        }
+        *entry = found->second;
+        return true;
+    }
+
+    /**
+     * Read the checksum attribute of a stored file, if it still matches the file.
+     *
+     * @param path
+     * @param filestat the file's stat
+     * @param crc
+     * @return false if there is no attribute or the file changed since it was saved
+     */
+    bool SavedChecksum(const std::string &path, const struct stat &filestat, std::uint32_t *crc)
+    {
+        std::int64_t mtime_ns = static_cast<std::int64_t>(filestat.st_mtim.tv_sec) * 1000000000 + filestat.st_mtim.tv_nsec;
+        char value[80];
+        ssize_t length = getxattr(path.c_str(), DFS_CHECKSUM_XATTR, value, sizeof(value) - 1);
+        if (length <= 0)
+        {
+            return false;
+        }
+        value[length] = '\0';
+        unsigned int saved_crc;
+        unsigned long long inode;
+        long long size, saved_mtime_ns;
+        if (std::sscanf(value, "%x %llu %lld %lld", &saved_crc, &inode, &size, &saved_mtime_ns) != 4 ||
+            inode != filestat.st_ino || size != filestat.st_size || saved_mtime_ns != mtime_ns)
+        {
+            return false;
+        }
+        *crc = saved_crc;
+        return true;
+    }
+
+    /**
+     * Checksum of a stored file, read from its checksum attribute while that still matches the file.
+     *
+     * The attribute survives restarts, so a file is only read in full once per
+     * version. Filesystems without user attributes just recompute the checksum.
+     *
+     * @param filename
+     * @return
+     */
+    std::uint32_t FileChecksum(const std::string &filename)
+    {
+        std::string path = WrapPath(filename);
+        DFSMappedFile mapped_file;
+        if (!mapped_file.Open(path))
+        {
+            return dfs_file_checksum(path, &this->crc_table);
+        }
+        const struct stat &filestat = mapped_file.Stat();
+        std::int64_t mtime_ns = static_cast<std::int64_t>(filestat.st_mtim.tv_sec) * 1000000000 + filestat.st_mtim.tv_nsec;
+
+        std::uint32_t crc;
+        if (SavedChecksum(path, filestat, &crc))
+        {
+            return crc;
+        }
+
+        mapped_file.AdviseSequential(0, mapped_file.Size());
+        crc = CRC::Calculate(mapped_file.Data(), mapped_file.Size(), this->crc_table);
+
+        // only save it if the file was not replaced while it was read
+        struct stat current;
+        if (stat(path.c_str(), &current) == 0 && current.st_ino == filestat.st_ino &&
+            current.st_size == filestat.st_size && current.st_mtim.tv_sec == filestat.st_mtim.tv_sec &&
+            current.st_mtim.tv_nsec == filestat.st_mtim.tv_nsec)
+        {
+            char value[80];
+            int length = std::snprintf(value, sizeof(value), "%08x %llu %lld %lld", crc,
+                                       static_cast<unsigned long long>(filestat.st_ino),
+                                       static_cast<long long>(filestat.st_size), static_cast<long long>(mtime_ns));
+            setxattr(path.c_str(), DFS_CHECKSUM_XATTR, value, length, 0);
+        }
+        return crc;
+    }
+
+    /**
+     * Remember the checksum of a file unless it changed since the checksum was read.
+     *
+     * @param filename
+     * @param version version of the metadata the checksum was read at
+     * @param crc
+     */
+    void StoreChecksum(const std::string &filename, std::uint64_t version, std::uint32_t crc)
+    {
+        std::unique_lock<std::shared_mutex> lock(this->metadata_mutex);
+        auto found = this->metadata.find(filename);
+        if (found != this->metadata.end() && found->second.version == version)
+        {
+            found->second.crc = crc;
+            found->second.has_crc = true;
+        }
+    }
+
+    /**
+     * Checksum of a stored file, from the table when it was read before.
+     *
+     * @param filename
+     * @param entry the file's metadata
+     * @return
+     */
+    std::uint32_t MetadataChecksum(const std::string &filename, const FileMetadata &entry)
+    {
+        if (entry.has_crc)
+        {
+            return entry.crc;
+        }
+        std::uint32_t crc = FileChecksum(filename);
+        StoreChecksum(filename, entry.version, crc);
+        return crc;
+    }
+
+    /**
+     * Add an entry for every stored file to a list response.
+     *
+     * Listings are answered from the table alone. Nothing is inlined, so the
+     * response stays small however many small files there are.
+     *
+     * @param response
+     */
+    void ListMetadata(ListResponse *response)
+    {
+        std::shared_lock<std::shared_mutex> lock(this->metadata_mutex);
+        response->mutable_fileinfo()->Reserve(this->metadata.size());
+        for (const auto &file : this->metadata)
+        {
+            auto *fileinfo = response->add_fileinfo();
+            fileinfo->set_filename(file.first);
+            fileinfo->set_mtime(file.second.mtime);
+            if (file.second.has_crc)
+            {
+                fileinfo->set_crc(file.second.crc);
+                fileinfo->set_has_crc(true);
+            }
+        }
+    }
+
+    /**
+     * Start watching the mount path so files changed by other processes are picked up.
+     *
+     * Under DFS_FANOUT only the server writes the shard tree, so nothing is watched.
+     */
+    void WatchMount()
+    {
+        if (DFS_FANOUT)
+        {
+            return;
+        }
+        this->watch_fd = inotify_init1(IN_CLOEXEC);
+        this->watch_stop_fd = eventfd(0, EFD_CLOEXEC);
+        if (this->watch_fd < 0 || this->watch_stop_fd < 0 ||
+            inotify_add_watch(this->watch_fd, mount_path.c_str(),
+                              IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0)
+        {
+            dfs_log(LL_ERROR) << "Could not watch " << mount_path << ", outside changes will be missed";
+            return;
+        }
+        this->watch_thread = std::thread(&DFSServiceImpl::HandleWatchEvents, this);
+    }
+
+    /**
+     * Refresh the metadata of every file inotify reports a change for, until stopped.
+     */
+    void HandleWatchEvents()
+    {
+        alignas(struct inotify_event) char buffer[64 * 1024];
+        struct pollfd fds[2] = {{this->watch_fd, POLLIN, 0}, {this->watch_stop_fd, POLLIN, 0}};
+        while (true)
+        {
+            if (poll(fds, 2, -1) < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return;
+            }
+            if (fds[1].revents != 0)
+            {
+                return;
+            }
+            ssize_t length = read(this->watch_fd, buffer, sizeof(buffer));
+            if (length <= 0)
+            {
+                continue;
+            }
+            for (char *next = buffer; next < buffer + length;)
+            {
+                const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(next);
+                next += sizeof(struct inotify_event) + event->len;
+                if (event->mask & IN_Q_OVERFLOW)
+                {
+                    dfs_log(LL_ERROR) << "Lost watch events, reloading the metadata table";
+                    ReloadMetadata();
+                }
+                else if (event->len > 0 && !(event->mask & IN_ISDIR) && !IsReservedName(event->name))
+                {
+                    RefreshMetadata(event->name);
+                }
+            }
+        }
+    }
+
+    /**
+     * Refresh every file in the table and pick up the ones it is missing.
+     */
+    void ReloadMetadata()
+    {
+        std::vector<std::string> filenames;
+        {
+            std::shared_lock<std::shared_mutex> lock(this->metadata_mutex);
+            filenames.reserve(this->metadata.size());
+            for (const auto &file : this->metadata)
+            {
+                filenames.push_back(file.first);
+            }
+        }
+        for (const std::string &filename : filenames)
+        {
+            RefreshMetadata(filename);
+        }
+        LoadMetadata();
+    }
+
+    /**
+     * Stop the watch thread and close the inotify instance.
+     */
+    void StopWatch()
+    {
+        if (this->watch_thread.joinable())
+        {
+            std::uint64_t stop = 1;
+            if (write(this->watch_stop_fd, &stop, sizeof(stop)) == sizeof(stop))
+            {
+                this->watch_thread.join();
+            }
+            else
+            {
+                this->watch_thread.detach();
+            }
+        }
+        if (this->watch_fd >= 0)
+        {
+            close(this->watch_fd);
+        }
+        if (this->watch_stop_fd >= 0)
+        {
+            close(this->watch_stop_fd);
+        }
+    }
+
+    /**
+     * Whether a directory entry is an in-progress upload rather than a stored file
+     *
+     * @param name
+     * @return
+     */
+    static bool IsTempFile(const char *name)
+    {
+        return std::strncmp(name, DFS_TEMP_PREFIX, sizeof(DFS_TEMP_PREFIX) - 1) == 0;
+    }
+
+    /**
+     * Whether a filename sent by a client collides with the server's own files
+     *
+     * @param filename
+     * @return
+     */
+    static bool IsReservedName(const std::string &filename)
+    {
+        return IsTempFile(filename.c_str()) ||
+               std::strncmp(filename.c_str(), DFS_BLOB_DIR, sizeof(DFS_BLOB_DIR) - 2) == 0 ||
+               std::strncmp(filename.c_str(), DFS_FETCH_TEMP_PREFIX, sizeof(DFS_FETCH_TEMP_PREFIX) - 1) == 0;
+    }
+
+    /** Answer to any request that names a reserved filename **/
+    static Status ReservedNameStatus()
+    {
+        return Status(StatusCode::INVALID_ARGUMENT, "The filename is reserved by the server");
+    }
+
+    /**
+     * Remove uploads left behind by a server that stopped mid-transfer.
+     */
+    void RemoveStaleUploads()
+    {
+        DIR *dir = opendir(mount_path.c_str());
+        if (dir == NULL)
+        {
+            return;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            if (entry->d_type == DT_REG && IsTempFile(entry->d_name))
+            {
+                dfs_log(LL_SYSINFO) << "Removing stale upload " << entry->d_name;
+                std::remove((this->mount_path + entry->d_name).c_str());
+            }
+        }
+        closedir(dir);
+    }
+
+    /**
+     * Path of the blob holding a content of the given checksum and size.
+     *
+     * @param crc
+     * @param size
+     * @return
+     */
+    std::string BlobPath(std::uint32_t crc, off_t size)
+    {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%08x-%llx", crc, static_cast<unsigned long long>(size));
+        return this->mount_path + DFS_BLOB_DIR + name;
+    }
+
+    /**
+     * Index the blob store and remove blobs no stored file links to anymore.
+     */
+    void LoadBlobs()
+    {
+        if (!DFS_CONTENT_ADDRESSED)
+        {
+            return;
+        }
+        std::string blob_dir = this->mount_path + DFS_BLOB_DIR;
+        if (mkdir(blob_dir.c_str(), 0755) != 0 && errno != EEXIST)
+        {
+            dfs_log(LL_ERROR) << "Could not create the blob store " << blob_dir;
+            return;
+        }
+        DIR *dir = opendir(blob_dir.c_str());
+        if (dir == NULL)
+        {
+            return;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            unsigned int crc;
+            unsigned long long size;
+            struct stat blobstat;
+            if (entry->d_type != DT_REG || std::sscanf(entry->d_name, "%8x-%llx", &crc, &size) != 2 ||
+                stat((blob_dir + entry->d_name).c_str(), &blobstat) != 0)
+            {
+                continue;
+            }
+            if (blobstat.st_nlink <= 1)
+            {
+                dfs_log(LL_SYSINFO) << "Removing unreferenced blob " << entry->d_name;
+                std::remove((blob_dir + entry->d_name).c_str());
+                continue;
+            }
+            this->blob_index[blobstat.st_ino] = crc;
+        }
+        closedir(dir);
+
+        std::ifstream journal(blob_dir + DFS_NAME_TIMES);
+        std::string line;
+        while (std::getline(journal, line))
+        {
+            unsigned long long inode;
+            long long mtime_ns;
+            int name_start = 0;
+            if (std::sscanf(line.c_str(), "%llu %lld %n", &inode, &mtime_ns, &name_start) == 2 && name_start > 0)
+            {
+                this->name_times[line.substr(name_start)] = {static_cast<ino_t>(inode), mtime_ns};
+            }
+        }
+    }
+
+    /**
+     * Rewrite the name times journal with the names still linked to the blob
+     * they were committed as, then open it for appending.
+     *
+     * Runs once the metadata table is loaded.
+     */
+    void CompactNameTimes()
+    {
+        if (!DFS_CONTENT_ADDRESSED)
+        {
+            return;
+        }
+        std::string journal = this->mount_path + DFS_BLOB_DIR + DFS_NAME_TIMES;
+        std::ofstream compacted(journal + ".new", std::ios::trunc);
+        for (auto name = this->name_times.begin(); name != this->name_times.end();)
+        {
+            FileMetadata entry;
+            if (!LookupMetadata(name->first, &entry) || entry.inode != name->second.inode)
+            {
+                name = this->name_times.erase(name);
+                continue;
+            }
+            compacted << name->second.inode << ' ' << name->second.mtime_ns << ' ' << name->first << '\n';
+            ++name;
+        }
+        compacted.close();
+        if (!compacted || rename((journal + ".new").c_str(), journal.c_str()) != 0)
+        {
+            dfs_log(LL_ERROR) << "Could not compact " << journal;
+        }
+        this->name_times_fd = open(journal.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    }
+
+    /**
+     * Record the commit time of a name about to be linked to a shared blob.
+     * Caller holds blob_mutex.
+     *
+     * @param filename
+     * @param inode inode of the blob
+     */
+    void RecordNameTime(const std::string &filename, ino_t inode)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        std::int64_t mtime_ns = static_cast<std::int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+        this->name_times[filename] = {inode, mtime_ns};
+
+        // journaled before the rename so a name never comes back with the blob's older time
+        if (this->name_times_fd >= 0)
+        {
+            std::string line = std::to_string(inode) + ' ' + std::to_string(mtime_ns) + ' ' + filename + '\n';
+            if (write(this->name_times_fd, line.data(), line.size()) == static_cast<ssize_t>(line.size()) &&
+                DFS_SYNC_POLICY != DFS_SYNC_NONE)
+            {
+                fdatasync(this->name_times_fd);
+            }
+        }
+    }
+
+    /**
+     * Replace the mtime of a name that shares a blob with the time it was committed at.
+     *
+     * @param filename
+     * @param filestat stat of the name, updated in place
+     */
+    void ApplyNameTime(const std::string &filename, struct stat *filestat)
+    {
+        std::lock_guard<std::mutex> lock(this->blob_mutex);
+        auto found = this->name_times.find(filename);
+        if (found != this->name_times.end() && found->second.inode == filestat->st_ino)
+        {
+            filestat->st_mtim.tv_sec = found->second.mtime_ns / 1000000000;
+            filestat->st_mtim.tv_nsec = found->second.mtime_ns % 1000000000;
+        }
+    }
+
+    /**
+     * Move a finished upload into the blob store.
+     *
+     * A new content becomes a blob by linking the upload to it. A content
+     * that is already stored replaces the upload with a link to the existing
+     * blob. The shared inode is never restamped, the name's own commit time is
+     * kept in the name times journal instead so it still reads as changed.
+     * The blob links are not synced, a lost one only costs the deduplication.
+     *
+     * @param temp_path
+     * @param filename the name the upload is committed as
+     */
+    void StoreBlob(const std::string &temp_path, const std::string &filename)
+    {
+        DFSMappedFile upload;
+        if (!upload.Open(temp_path))
+        {
+            return;
+        }
+        upload.AdviseSequential(0, upload.Size());
+        std::uint32_t crc = CRC::Calculate(upload.Data(), upload.Size(), this->crc_table);
+        std::string blob_path = BlobPath(crc, upload.Size());
+
+        {
+            std::lock_guard<std::mutex> lock(this->blob_mutex);
+            if (link(temp_path.c_str(), blob_path.c_str()) == 0)
+            {
+                this->blob_index[upload.Stat().st_ino] = crc;
+                return;
+            }
+            if (errno != EEXIST)
+            {
+                return;
+            }
+        }
+
+        // compare without the lock, blobs are never written once linked
+        DFSMappedFile blob;
+        if (!blob.Open(blob_path) || blob.Size() != upload.Size() ||
+            (upload.Size() > 0 && std::memcmp(blob.Data(), upload.Data(), upload.Size()) != 0))
+        {
+            // checksum collision, this content stays outside the store
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(this->blob_mutex);
+        struct stat blobstat;
+        if (stat(blob_path.c_str(), &blobstat) != 0 || blobstat.st_ino != blob.Stat().st_ino)
+        {
+            // the blob was released while it was compared
+            return;
+        }
+        std::string alias = temp_path + ".blob";
+        if (link(blob_path.c_str(), alias.c_str()) != 0)
+        {
+            return;
+        }
+        RecordNameTime(filename, blobstat.st_ino);
+        if (rename(alias.c_str(), temp_path.c_str()) != 0)
+        {
+            std::remove(alias.c_str());
+        }
+    }
+
+    /**
+     * Remove the blob of a replaced or deleted file once no other name links to it.
+     *
+     * @param filestat the file as it was before it went away
+     */
+    void ReleaseBlob(const struct stat &filestat)
+    {
+        std::lock_guard<std::mutex> lock(this->blob_mutex);
+        auto blob = this->blob_index.find(filestat.st_ino);
+        if (blob == this->blob_index.end())
+        {
+            return;
+        }
+        std::string blob_path = BlobPath(blob->second, filestat.st_size);
+        struct stat blobstat;
+        if (stat(blob_path.c_str(), &blobstat) == 0 && blobstat.st_ino == filestat.st_ino)
+        {
+            if (blobstat.st_nlink > 1)
+            {
+                return;
+            }
+            std::remove(blob_path.c_str());
+        }
+        this->blob_index.erase(blob);
+    }
+
+    /**
+     * Look up the checksum of a stored file in the blob index.
+     *
+     * @param filestat
+     * @param crc
+     * @return false if the file is not in the blob store
+     */
+    bool BlobChecksum(const struct stat &filestat, std::uint32_t *crc)
+    {
+        std::lock_guard<std::mutex> lock(this->blob_mutex);
+        auto blob = this->blob_index.find(filestat.st_ino);
+        if (blob == this->blob_index.end())
+        {
+            return false;
+        }
+        *crc = blob->second;
+        return true;
+    }
+
+    /**
+     * Make an upload durable per DFS_SYNC_POLICY and rename it over the stored file.
+     *
+     * Readers that already mapped the old version keep streaming it,
+     * new readers see the complete new version.
+     *
+     * @param fd
+     * @param temp_path
+     * @param filename
+     * @param drop_cache drop the file from the page cache once it is on disk
+     * @return false if the upload could not be committed
+     */
+    bool CommitUpload(FileDescriptor fd, const std::string &temp_path, const std::string &filename,
+                      bool drop_cache = false)
+    {
+        // mkstemp creates the file owner-only
+        bool ok = fchmod(fd, 0644) == 0;
+        if (ok && DFS_SYNC_POLICY == DFS_SYNC_FDATASYNC)
+        {
+            ok = fdatasync(fd) == 0;
+        }
+        else if (ok && DFS_SYNC_POLICY == DFS_SYNC_GROUP)
+        {
+            ok = this->group_commit.Sync(fd);
+        }
+        if (ok && drop_cache)
+        {
+            dfs_drop_written(fd, 0, 0);
+        }
+        close(fd);
+
+        struct stat replaced;
+        bool replacing = false;
+        if (ok)
+        {
+            InvalidateCachedFile(filename);
+            ok = !DFS_FANOUT || MakeShard(filename);
+        }
+        if (ok && DFS_CONTENT_ADDRESSED)
+        {
+            StoreBlob(temp_path, filename);
+            replacing = stat(WrapPath(filename).c_str(), &replaced) == 0;
+        }
+        if (!ok || rename(temp_path.c_str(), WrapPath(filename).c_str()) != 0)
+        {
+            std::remove(temp_path.c_str());
+            return false;
+        }
+        if (replacing)
+        {
+            // renaming over another link to the same blob leaves both names in place
+            struct stat leftover;
+            if (stat(temp_path.c_str(), &leftover) == 0 && leftover.st_ino == replaced.st_ino)
+            {
+                std::remove(temp_path.c_str());
+            }
+            ReleaseBlob(replaced);
+        }
+
+        if (DFS_SYNC_POLICY == DFS_SYNC_FDATASYNC)
+        {
+            // persist the rename itself
+            SyncDirectory(ShardDir(filename));
+        }
+        else if (DFS_SYNC_POLICY == DFS_SYNC_GROUP)
+        {
+            // the renames of a batch are flushed by one more shared syncfs
+            FileDescriptor dir_fd = open(ShardDir(filename).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (dir_fd >= 0)
+            {
+                this->group_commit.Sync(dir_fd);
+                close(dir_fd);
+            }
+        }
+        RefreshMetadata(filename);
+        NotifySync(filename);
+        return true;
+    }
+
+    /**
+     * Push a change notice for a newly stored file to every open sync session.
+     *
+     * The client holding the write lock is the one that stored the file, so
+     * its own sessions are skipped.
+     *
+     * @param filename
+     */
+    void NotifySync(const std::string &filename)
+    {
+        std::string origin;
+        {
+            std::lock_guard<std::mutex> lock(write_locks_mutex);
+            auto holder = write_locks.find(filename);
+            if (holder != write_locks.end())
+            {
+                origin = holder->second;
+            }
+        }
+
+        ListResponse::FileInfo notice;
+        notice.set_filename(filename);
+        FileMetadata entry;
+        if (!LookupMetadata(filename, &entry))
+        {
+            return;
+        }
+        notice.set_mtime(entry.mtime);
+        ReadInline(filename, entry.size, &notice);
+
+        std::lock_guard<std::mutex> lock(this->sync_sessions_mutex);
+        for (SyncReactor *session : this->sync_sessions)
+        {
+            if (origin.empty() || !session->BelongsTo(origin))
+            {
+                session->Notify(notice);
+            }
+        }
+    }
+
+    /**
+     * Throw away an upload that did not complete.
+     *
+     * @param fd
+     * @param temp_path
+     */
+    void DiscardUpload(FileDescriptor fd, const std::string &temp_path)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            std::remove(temp_path.c_str());
+        }
+    }
+
+    /**
+     * Resolve the byte range asked for by a GetRequest against the file.
+     *
+     * @param mapped_file
+     * @param request
+     * @param offset set to the first byte to send
+     * @param end set to one past the last byte to send
+     * @return OUT_OF_RANGE if the range starts outside the file
+     */
+    static Status ResolveRange(const DFSMappedFile &mapped_file, const GetRequest &request,
+                               std::size_t *offset, std::size_t *end)
+    {
+        if (request.offset() < 0 || request.length() < 0 ||
+            static_cast<std::uint64_t>(request.offset()) > mapped_file.Size())
+        {
+            return Status(StatusCode::OUT_OF_RANGE, "The requested range is outside the file");
+        }
+        *offset = static_cast<std::size_t>(request.offset());
+        *end = mapped_file.Size();
+        if (request.length() > 0)
+        {
+            *end = std::min<std::size_t>(*end, *offset + static_cast<std::size_t>(request.length()));
+        }
+        return Status::OK;
+    }
+
+    /**
+     * Fill a response with the chunk starting at offset.
+     *
+     * Chunks end on block boundaries so small files can be served through
+     * the block cache. The chunk DFS_PREFETCH_CHUNKS ahead is prefetched
+     * so the disk keeps working while this one is sent.
+     *
+     * @param mapped_file
+     * @param offset
+     * @param end
+     * @param chunk
+     * @return the number of bytes in the chunk
+     */
+    std::size_t ReadChunk(const DFSMappedFile &mapped_file, std::size_t offset, std::size_t end, std::string *chunk)
+    {
+        std::size_t block = offset / DFS_CHUNK_SIZE;
+        std::size_t block_offset = offset % DFS_CHUNK_SIZE;
+        std::size_t chunk_size = std::min<std::size_t>(DFS_CHUNK_SIZE - block_offset, end - offset);
+
+        const std::size_t prefetch_window = DFS_PREFETCH_CHUNKS * DFS_CHUNK_SIZE;
+        if (offset + prefetch_window < end)
+        {
+            mapped_file.Prefetch(offset + prefetch_window, std::min(chunk_size, end - offset - prefetch_window));
+        }
+
+        // Small files are served through the block cache
+        if (mapped_file.Size() <= DFS_BLOCK_CACHE_MAX_FILE && chunk_size > 0)
+        {
+            DFSBlockCache::Key key = DFSBlockCache::MakeKey(mapped_file.Stat(), block);
+            std::shared_ptr<const std::string> cached = this->block_cache.Get(key);
+            if (!cached)
+            {
+                std::size_t block_start = block * DFS_CHUNK_SIZE;
+                std::size_t block_size = std::min<std::size_t>(DFS_CHUNK_SIZE, mapped_file.Size() - block_start);
+                cached = std::make_shared<const std::string>(mapped_file.Data() + block_start, block_size);
+                this->block_cache.Put(key, cached);
+            }
+            chunk->assign(cached->data() + block_offset, chunk_size);
+        }
+        else
+        {
+            chunk->assign(mapped_file.Data() + offset, chunk_size);
+        }
+        return chunk_size;
+    }
+
+    /**
+     * Read a small file whole so it can be inlined in a status response or change notice
+     *
+     * The file is read on the stack and only copied into the message once it
+     * is known to fit, so entries of large files never get a content buffer.
+     *
+     * @param filename
+     * @param size size of the file as last seen
+     * @param message a StatusResponse or a change notice
+     * @return false if the file is over DFS_INLINE_MAX_FILE or could not be read
+     */
+    template <typename Message>
+    bool ReadInline(const std::string &filename, std::int64_t size, Message *message)
+    {
+        if (size > DFS_INLINE_MAX_FILE)
+        {
+            return false;
+        }
+        int fd = open(WrapPath(filename).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        // read one byte past the limit to notice a file that grew since the stat
+        char buffer[DFS_INLINE_MAX_FILE + 1];
+        std::size_t total = 0;
+        while (total < sizeof(buffer))
+        {
+            ssize_t bytes = read(fd, buffer + total, sizeof(buffer) - total);
+            if (bytes < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (bytes <= 0)
+            {
+                if (bytes < 0)
+                {
+                    total = sizeof(buffer);
+                }
+                break;
+            }
+            total += bytes;
+        }
+        close(fd);
+        if (total > DFS_INLINE_MAX_FILE)
+        {
+            return false;
+        }
+        message->set_content(buffer, total);
+        message->set_inlined(true);
+        message->set_crc(CRC::Calculate(buffer, total, this->crc_table));
+        return true;
+    }
+
+    /**
+     * Whether a file is worth compressing on the wire. The verdict is sampled
+     * once per version of the file and remembered by inode and mtime.
+     *
+     * @param mapped_file
+     * @return
+     */
+    bool IsCompressible(const DFSMappedFile &mapped_file)
+    {
+        const struct stat &filestat = mapped_file.Stat();
+        std::int64_t mtime_ns = static_cast<std::int64_t>(filestat.st_mtim.tv_sec) * 1000000000 + filestat.st_mtim.tv_nsec;
+        {
+            std::lock_guard<std::mutex> lock(this->compressible_mutex);
+            auto found = this->compressible_files.find(filestat.st_ino);
+            if (found != this->compressible_files.end() && found->second.first == mtime_ns)
+            {
+                return found->second.second;
+            }
+        }
+
+        bool compressible = dfs_is_compressible(mapped_file.Data(), mapped_file.Size());
+
+        std::lock_guard<std::mutex> lock(this->compressible_mutex);
+        if (this->compressible_files.size() >= DFS_COMPRESSIBLE_CACHE_FILES)
+        {
+            this->compressible_files.clear();
+        }
+        this->compressible_files[filestat.st_ino] = {mtime_ns, compressible};
+        return compressible;
+    }
+
+    /**
+     * Answer a unary RPC from the disk pool.
+     *
+     * @param context
+     * @param handler
+     * @return the reactor that is finished with the handler's status
+     */
+    ServerUnaryReactor *RunOnDiskPool(CallbackServerContext *context, std::function<Status()> handler)
+    {
+        ServerUnaryReactor *reactor = context->DefaultReactor();
+        this->disk_pool.Post([reactor, handler]
+                             { reactor->Finish(handler()); });
+        return reactor;
+    }
+
+    /**
+     * Streams a file, or a range of it, to the client.
+     *
+     * Each chunk is read on the disk pool and handed to gRPC with StartWrite.
+     * The next chunk is read once the previous write completes, so a slow
+     * client holds at most one chunk in memory. Writes carry a buffer hint so
+     * gRPC sends DFS_WRITE_BATCH_CHUNKS of them as one transport write, and
+     * the last chunk goes out together with the status.
+     *
+     * When the request carries signatures of the client's stale copy, the file
+     * is diffed against them first and only copy instructions and the changed
+     * bytes are streamed.
+     */
+    class GetFileReactor : public grpc::ServerWriteReactor<GetResponse>
+    {
+
+    private:
+        DFSServiceImpl *service;
+        CallbackServerContext *context;
+        const GetRequest *request;
+
+        DFSMappedFile mapped_file;
+        GetResponse response;
+
+        /** Next byte to send **/
+        std::size_t offset = 0;
+
+        /** One past the last byte to send **/
+        std::size_t end = 0;
+
+        /** Writes buffered by gRPC since the last flush **/
+        int batched = 0;
+
+        /** The file is too large to keep in the page cache once sent **/
+        bool bypass_cache = false;
+
+        /** Bytes before this offset have been dropped from the page cache **/
+        std::size_t released = 0;
+
+        /** Delta download: the ops that rebuild the file from the client's copy **/
+        std::vector<DFSDeltaOp> delta_ops;
+
+        /** Delta download: the op being sent and how far into it **/
+        std::size_t delta_op = 0;
+        std::int64_t delta_op_sent = 0;
+
+        /** Set when the client goes away so no more chunks are read **/
+        std::atomic<bool> cancelled{false};
+
+        void Start()
+        {
+            if (IsReservedName(this->request->filename()))
+            {
+                Finish(ReservedNameStatus());
+                return;
+            }
+
+            // Check if file exist. If not, return status message
+            if (!this->mapped_file.Open(this->service->WrapPath(this->request->filename())))
+            {
+                Finish(Status(StatusCode::NOT_FOUND, "The requested file is not found"));
+                return;
+            }
+
+            Status range = ResolveRange(this->mapped_file, *this->request, &this->offset, &this->end);
+            if (!range.ok())
+            {
+                Finish(range);
+                return;
+            }
+
+            if (this->request->signature_size() > 0 && this->request->block_size() > 0)
+            {
+                if (this->offset != 0 || this->end != this->mapped_file.Size())
+                {
+                    Finish(Status(StatusCode::INVALID_ARGUMENT, "Delta downloads cover the whole file"));
+                    return;
+                }
+                this->delta_ops = dfs_compute_delta(this->mapped_file.Data(), this->mapped_file.Size(),
+                                                    this->request->block_size(), this->request->signature(),
+                                                    &this->service->crc_table);
+            }
+
+            // negotiated against the encodings the client accepts, before the first write sends the headers
+            grpc_compression_level level = this->service->compression_level.load(std::memory_order_relaxed);
+            if (level != GRPC_COMPRESS_LEVEL_NONE && this->service->IsCompressible(this->mapped_file))
+            {
+                this->context->set_compression_level(level);
+            }
+
+            this->bypass_cache = DFS_BYPASS_CACHE_MIN_FILE > 0 && this->mapped_file.Size() >= DFS_BYPASS_CACHE_MIN_FILE;
+            this->released = this->offset;
+
+            // the range is read front to back; a partial range (a stripe or a resume) is
+            // wanted in full right away, so the kernel can start on more of it up front
+            this->mapped_file.AdviseSequential(this->offset, this->end - this->offset);
+            std::size_t readahead = DFS_PREFETCH_CHUNKS * DFS_CHUNK_SIZE;
+            if (this->offset > 0 || this->end < this->mapped_file.Size())
+            {
+                readahead = std::max<std::size_t>(readahead, DFS_RANGE_READAHEAD);
+            }
+            this->mapped_file.Prefetch(this->offset, std::min(readahead, this->end - this->offset));
+            NextWrite();
+        }
+
+        /**
+         * Fill the response with the next delta op, splitting literal
+         * ranges into chunks. Advances offset past the bytes it covers.
+         */
+        void ReadDeltaChunk()
+        {
+            this->response.Clear();
+            if (this->delta_op >= this->delta_ops.size())
+            {
+                return;
+            }
+
+            const DFSDeltaOp &op = this->delta_ops[this->delta_op];
+            if (op.copy)
+            {
+                this->response.set_copy_offset(op.offset);
+                this->response.set_copy_length(op.length);
+                this->offset += op.length;
+                this->delta_op++;
+                return;
+            }
+
+            std::int64_t chunk_size = std::min<std::int64_t>(DFS_CHUNK_SIZE, op.length - this->delta_op_sent);
+            this->response.set_filechunk(this->mapped_file.Data() + op.offset + this->delta_op_sent, chunk_size);
+            this->offset += chunk_size;
+            this->delta_op_sent += chunk_size;
+            if (this->delta_op_sent >= op.length)
+            {
+                this->delta_op++;
+                this->delta_op_sent = 0;
+            }
+        }
+
+        void NextWrite()
+        {
+            // Stop reading the disk as soon as the client is gone
+            if (this->cancelled || this->context->IsCancelled())
+            {
+                Finish(Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded"));
+                return;
+            }
+            if (this->delta_ops.empty())
+            {
+                this->offset += this->service->ReadChunk(this->mapped_file, this->offset, this->end,
+                                                         this->response.mutable_filechunk());
+            }
+            else
+            {
+                ReadDeltaChunk();
+            }
+
+            // the chunk is copied into the response, its pages are not needed again
+            if (this->bypass_cache)
+            {
+                this->mapped_file.Release(this->released, this->offset - this->released);
+                this->released = this->offset;
+            }
+
+            if (this->offset >= this->end)
+            {
+                StartWriteLast(&this->response, grpc::WriteOptions());
+            }
+            else if (++this->batched < DFS_WRITE_BATCH_CHUNKS)
+            {
+                StartWrite(&this->response, grpc::WriteOptions().set_buffer_hint());
+            }
+            else
+            {
+                this->batched = 0;
+                StartWrite(&this->response);
+            }
+        }
+
+    public:
+        GetFileReactor(DFSServiceImpl *service, CallbackServerContext *context, const GetRequest *request)
+            : service(service), context(context), request(request)
+        {
+            this->service->disk_pool.Post([this]
+                                          { Start(); });
+        }
+
+        void OnCancel() override
+        {
+            this->cancelled = true;
+        }
+
+        void OnWriteDone(bool ok) override
+        {
+            if (!ok || this->cancelled)
+            {
+                Finish(Status(StatusCode::CANCELLED, "The client stopped reading"));
+            }
+            else if (this->offset >= this->end)
+            {
+                dfs_log(LL_DEBUG2) << "Block cache hits: " << this->service->block_cache.Hits()
+                                   << ", misses: " << this->service->block_cache.Misses();
+                Finish(Status::OK);
+            }
+            else
+            {
+                this->service->disk_pool.Post([this]
+                                              { NextWrite(); });
+            }
+        }
+
+        void OnDone() override
+        {
+            delete this;
+        }
+    };
+
+    /**
+     * Streams several whole files back to back.
+     *
+     * Every message names its file. The first one of a file carries its size
+     * and mtime and the last one is flagged eof, so the client can tell where
+     * one file ends and the next begins without a call per file.
+     */
+    class GetFilesReactor : public grpc::ServerWriteReactor<GetFilesResponse>
+    {
+
+    private:
+        DFSServiceImpl *service;
+        CallbackServerContext *context;
+        const GetFilesRequest *request;
+
+        DFSMappedFile mapped_file;
+        GetFilesResponse response;
+
+        /** The file being sent **/
+        int file_index = 0;
+
+        /** Whether mapped_file holds the file being sent **/
+        bool file_open = false;
+
+        /** Next byte of the file to send **/
+        std::size_t offset = 0;
+
+        /** Writes buffered by gRPC since the last flush **/
+        int batched = 0;
+
+        /** Set when the client goes away so no more chunks are read **/
+        std::atomic<bool> cancelled{false};
+
+        bool Done() const
+        {
+            return this->file_index >= this->request->filename_size();
+        }
+
+        void NextWrite()
+        {
+            // Stop reading the disk as soon as the client is gone
+            if (this->cancelled || this->context->IsCancelled())
+            {
+                Finish(Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded"));
+                return;
+            }
+
+            this->response.Clear();
+            const std::string &filename = this->request->filename(this->file_index);
+            this->response.set_filename(filename);
+            if (!this->file_open)
+            {
+                if (IsReservedName(filename) || !this->mapped_file.Open(this->service->WrapPath(filename)))
+                {
+                    this->response.set_missing(true);
+                    this->response.set_eof(true);
+                    this->file_index++;
+                    Write();
+                    return;
+                }
+                this->file_open = true;
+                this->offset = 0;
+                this->response.set_size(this->mapped_file.Size());
+
+                // a deduplicated name reports its own commit time, not the shared blob's
+                FileMetadata entry;
+                if (this->service->LookupMetadata(filename, &entry) && entry.inode == this->mapped_file.Stat().st_ino)
+                {
+                    this->response.set_mtime(entry.mtime);
+                }
+                else
+                {
+                    this->response.set_mtime(this->mapped_file.Stat().st_mtime);
+                }
+
+                const std::size_t prefetch_window = DFS_PREFETCH_CHUNKS * DFS_CHUNK_SIZE;
+                this->mapped_file.AdviseSequential(0, this->mapped_file.Size());
+                this->mapped_file.Prefetch(0, std::min(prefetch_window, this->mapped_file.Size()));
+            }
+
+            this->offset += this->service->ReadChunk(this->mapped_file, this->offset, this->mapped_file.Size(),
+                                                     this->response.mutable_filechunk());
+            if (this->offset >= this->mapped_file.Size())
+            {
+                this->response.set_eof(true);
+                this->mapped_file.Close();
+                this->file_open = false;
+                this->file_index++;
+            }
+            Write();
+        }
+
+        void Write()
+        {
+            if (Done())
+            {
+                StartWriteLast(&this->response, grpc::WriteOptions());
+            }
+            else if (++this->batched < DFS_WRITE_BATCH_CHUNKS)
+            {
+                StartWrite(&this->response, grpc::WriteOptions().set_buffer_hint());
+            }
+            else
+            {
+                this->batched = 0;
+                StartWrite(&this->response);
+            }
+        }
+
+    public:
+        GetFilesReactor(DFSServiceImpl *service, CallbackServerContext *context, const GetFilesRequest *request)
+            : service(service), context(context), request(request)
+        {
+            if (Done())
+            {
+                Finish(Status::OK);
+                return;
+            }
+            this->service->disk_pool.Post([this]
+                                          { NextWrite(); });
+        }
+
+        void OnCancel() override
+        {
+            this->cancelled = true;
+        }
+
+        void OnWriteDone(bool ok) override
+        {
+            if (!ok || this->cancelled)
+            {
+                Finish(Status(StatusCode::CANCELLED, "The client stopped reading"));
+            }
+            else if (Done())
+            {
+                Finish(Status::OK);
+            }
+            else
+            {
+                this->service->disk_pool.Post([this]
+                                              { NextWrite(); });
+            }
+        }
+
+        void OnDone() override
+        {
+            delete this;
+        }
+    };
+
+    /**
+     * Receives several whole files over one stream.
+     *
+     * The first message names every file of the batch and their write locks
+     * are taken together under one hold of write_locks_mutex. Files whose lock
+     * belongs to another client are skipped. Each file is staged in a temporary
+     * file and committed when its eof message arrives, unless its crc shows
+     * the stored copy is the same. The locks are released together when the
+     * stream ends and the response lists the outcome per file.
+     */
+    class StoreFilesReactor : public grpc::ServerReadReactor<StoreFilesRequest>
+    {
+
+    private:
+        DFSServiceImpl *service;
+        CallbackServerContext *context;
+        StoreFilesResponse *response;
+        StoreFilesRequest request;
+
+        std::string cid;
+
+        /** The next message processed is the first of the stream **/
+        bool first = true;
+
+        /** Files of the batch whose write lock this stream holds **/
+        std::unordered_set<std::string> locked;
+
+        /** The file being received **/
+        std::string filename;
+        std::string temp_path;
+        FileDescriptor fd = -1;
+        off_t offset = 0;
+
+        /** A file has started and its eof message has not arrived yet **/
+        bool receiving = false;
+
+        /** The file being received failed or is already stored, the rest of it is dropped up to its eof **/
+        bool failed = false;
+
+        void AddResult(const std::string &filename, StatusCode code, std::int64_t mtime = 0)
+        {
+            auto *result = this->response->add_result();
+            result->set_filename(filename);
+            result->set_code(code);
+            result->set_mtime(mtime);
+        }
+
+        /**
+         * Whether the stored copy of a file matches the crc the client sent
+         *
+         * @param filename
+         * @param mtime set to the stored copy's mtime
+         */
+        bool AlreadyStored(const std::string &filename, std::int64_t *mtime)
+        {
+            FileMetadata entry;
+            if (!this->request.has_crc() || !this->service->LookupMetadata(filename, &entry) ||
+                this->service->MetadataChecksum(filename, entry) != this->request.crc())
+            {
+                return false;
+            }
+            *mtime = entry.mtime;
+            return true;
+        }
+
+        void LockGroup()
+        {
+            this->cid = this->request.cid();
+
+            // abandoned upload sessions give their locks up first
+            std::lock_guard<std::mutex> sessions_lock(this->service->upload_sessions_mutex);
+            this->service->ExpireUploadSessions();
+            std::lock_guard<std::mutex> lock(this->service->write_locks_mutex);
+            for (const std::string &filename : this->request.lock_filename())
+            {
+                if (IsReservedName(filename))
+                {
+                    AddResult(filename, StatusCode::INVALID_ARGUMENT);
+                    continue;
+                }
+                if (this->service->TakeWriteLock(filename, this->cid))
+                {
+                    this->locked.insert(filename);
+                    this->service->CountOpenStore(filename, 1);
+                }
+                else
+                {
+                    AddResult(filename, StatusCode::RESOURCE_EXHAUSTED);
+                }
+            }
+        }
+
+        void UnlockGroup()
+        {
+            std::lock_guard<std::mutex> lock(this->service->write_locks_mutex);
+            for (const std::string &filename : this->locked)
+            {
+                this->service->CountOpenStore(filename, -1);
+                auto holder = this->service->write_locks.find(filename);
+                if (holder != this->service->write_locks.end() && holder->second == this->cid)
+                {
+                    this->service->write_locks.erase(holder);
+                }
+            }
+        }
+
+        /**
+         * Drop the file being received, it did not reach its eof message.
+         * A file that already failed has its result recorded.
+         */
+        void AbandonFile()
+        {
+            if (this->receiving && !this->failed)
+            {
+                this->service->DiscardUpload(this->fd, this->temp_path);
+                AddResult(this->filename, StatusCode::CANCELLED);
+            }
+            this->fd = -1;
+            this->receiving = false;
+        }
+
+        /**
+         * Apply one received message on the disk pool, then read the next
+         */
+        void Process()
+        {
+            if (this->first)
+            {
+                this->first = false;
+                LockGroup();
+            }
+
+            const std::string &filename = this->request.filename();
+            if (!filename.empty() && this->locked.count(filename) > 0)
+            {
+                // a new file starts, the chunks of a failed one are skipped up to its eof
+                if (!this->receiving || filename != this->filename)
+                {
+                    AbandonFile();
+                    this->filename = filename;
+                    this->temp_path = this->service->UploadTemplate(filename);
+                    this->fd = mkostemp(&this->temp_path[0], O_CLOEXEC);
+                    this->offset = 0;
+                    this->receiving = true;
+                    this->failed = this->fd < 0;
+                    std::int64_t mtime;
+                    if (this->failed)
+                    {
+                        AddResult(filename, StatusCode::CANCELLED);
+                    }
+                    else if (AlreadyStored(filename, &mtime))
+                    {
+                        this->service->DiscardUpload(this->fd, this->temp_path);
+                        this->fd = -1;
+                        this->failed = true;
+                        AddResult(filename, StatusCode::ALREADY_EXISTS, mtime);
+                    }
+                }
+
+                const std::string &chunk = this->request.filechunk();
+                if (!this->failed && !dfs_pwrite_all(this->fd, chunk.data(), chunk.size(), this->offset))
+                {
+                    this->service->DiscardUpload(this->fd, this->temp_path);
+                    this->fd = -1;
+                    this->failed = true;
+                    AddResult(filename, StatusCode::CANCELLED);
+                }
+                this->offset += chunk.size();
+
+                if (this->request.eof())
+                {
+                    if (!this->failed)
+                    {
+                        FileMetadata entry;
+                        if (this->service->CommitUpload(this->fd, this->temp_path, filename) &&
+                            this->service->LookupMetadata(filename, &entry))
+                        {
+                            AddResult(filename, StatusCode::OK, entry.mtime);
+                        }
+                        else
+                        {
+                            AddResult(filename, StatusCode::CANCELLED);
+                        }
+                    }
+                    this->fd = -1;
+                    this->receiving = false;
+                }
+            }
+            StartRead(&this->request);
+        }
+
+    public:
+        StoreFilesReactor(DFSServiceImpl *service, CallbackServerContext *context, StoreFilesResponse *response)
+            : service(service), context(context), response(response)
+        {
+            StartRead(&this->request);
+        }
+
+        void OnReadDone(bool ok) override
+        {
+            if (ok)
+            {
+                this->service->disk_pool.Post([this]
+                                              { Process(); });
+                return;
+            }
+
+            // the client finished sending or went away
+            this->service->disk_pool.Post([this]
+                                          {
+                AbandonFile();
+                UnlockGroup();
+                if (this->context->IsCancelled())
+                {
+                    Finish(Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded"));
+                    return;
+                }
+                Finish(Status::OK); });
+        }
+
+        void OnDone() override
+        {
+            delete this;
+        }
+    };
+
+    /**
+     * A long-lived session multiplexing the unary calls, fetches and stores
+     * of one client, tagged with correlation ids, plus pushed change notices.
+     *
+     * Stat, lock, delete and list run on the disk pool as soon as they are
+     * read, so commands pipeline and may answer out of order. Uploads stay on
+     * DFSStoreFile, which can resume them. Fetches are sent a chunk at a time,
+     * taking turns with each other whenever the stream is free, so a large
+     * fetch does not hold up the answers to later commands.
+     */
+    class SyncReactor : public grpc::ServerBidiReactor<SyncRequest, SyncResponse>
+    {
+
+    private:
+        struct FetchState
+        {
+            std::uint64_t id;
+            DFSMappedFile mapped_file;
+            std::size_t offset = 0;
+            std::size_t end = 0;
+        };
+
+        DFSServiceImpl *service;
+        CallbackServerContext *context;
+        SyncRequest request;
+
+        /** The client the session's locks belong to **/
+        std::string cid;
+
+        /** Mutex for the session state below **/
+        std::mutex mutex;
+
+        /** Responses waiting for the stream, the front one is being written **/
+        std::deque<SyncResponse> queue;
+
+        /** Fetches with chunks left to send **/
+        std::list<std::unique_ptr<FetchState>> fetches;
+
+        /** Sent chunk responses kept so their buffers are refilled by the next chunks **/
+        std::vector<SyncResponse> spare;
+
+        /** A write or a fetch chunk read is outstanding **/
+        bool writing = false;
+
+        /** The client finished sending or went away **/
+        bool reads_done = false;
+
+        /** A write failed, nothing more is sent **/
+        bool broken = false;
+
+        /** Finish has been decided on **/
+        bool finished = false;
+
+        /** Commands posted to the disk pool that have not answered **/
+        int pending = 0;
+
+        /** Files whose write lock was granted over this session, released when it ends **/
+        std::unordered_set<std::string> locked;
+
+        /**
+         * Release the write locks of the session that the client still holds.
+         *
+         * A lock an upload is still using is kept: a store stream writing the
+         * file releases it when it ends, an upload session when it commits or
+         * expires, so a resume after the session dropped still finds it.
+         */
+        void ReleaseLocks()
+        {
+            std::lock_guard<std::mutex> sessions_lock(this->service->upload_sessions_mutex);
+            std::unordered_set<std::string> uploading;
+            for (const auto &session : this->service->upload_sessions)
+            {
+                if (session.second.cid == this->cid)
+                {
+                    uploading.insert(session.second.filename);
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(this->service->write_locks_mutex);
+            for (const std::string &filename : this->locked)
+            {
+                if (uploading.count(filename) > 0 || this->service->open_stores.count(filename) > 0)
+                {
+                    continue;
+                }
+                auto holder = this->service->write_locks.find(filename);
+                if (holder != this->service->write_locks.end() && holder->second == this->cid)
+                {
+                    this->service->write_locks.erase(holder);
+                }
+            }
+            this->locked.clear();
+        }
+
+        /**
+         * Decide under the mutex what to do next and do it once the mutex is released
+         *
+         * @param lock holds mutex, released on return
+         */
+        void Continue(std::unique_lock<std::mutex> &lock)
+        {
+            SyncResponse *write = nullptr;
+            bool pump = false;
+            bool finish = false;
+            if (!this->writing && !this->broken && !this->finished)
+            {
+                if (!this->queue.empty())
+                {
+                    this->writing = true;
+                    write = &this->queue.front();
+                }
+                else if (!this->fetches.empty())
+                {
+                    this->writing = true;
+                    pump = true;
+                }
+            }
+            if (!this->finished && this->reads_done && this->pending == 0 && !this->writing &&
+                (this->broken || (this->queue.empty() && this->fetches.empty())))
+            {
+                this->finished = true;
+                finish = true;
+            }
+            lock.unlock();
+
+            if (write != nullptr)
+            {
+                StartWrite(write);
+            }
+            if (pump)
+            {
+                this->service->disk_pool.Post([this]
+                                              { Pump(); });
+            }
+            if (finish)
+            {
+                {
+                    std::lock_guard<std::mutex> sessions_lock(this->service->sync_sessions_mutex);
+                    this->service->sync_sessions.erase(this);
+                }
+                ReleaseLocks();
+                Finish(this->context->IsCancelled() ? Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded") : Status::OK);
+            }
+        }
+
+        /**
+         * Queue the answer to a command that ran on the disk pool
+         *
+         * @param response
+         */
+        void Answer(SyncResponse response)
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->pending--;
+            if (!this->broken)
+            {
+                this->queue.push_back(std::move(response));
+            }
+            Continue(lock);
+        }
+
+        static void SetStatus(const Status &status, SyncResponse *response)
+        {
+            response->set_code(status.error_code());
+            response->set_message(status.error_message());
+        }
+
+        /**
+         * Read the next chunk of the fetch whose turn it is
+         */
+        void Pump()
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            if (this->fetches.empty())
+            {
+                this->writing = false;
+                Continue(lock);
+                return;
+            }
+            std::unique_ptr<FetchState> fetch = std::move(this->fetches.front());
+            this->fetches.pop_front();
+            SyncResponse response;
+            if (!this->spare.empty())
+            {
+                response = std::move(this->spare.back());
+                this->spare.pop_back();
+            }
+            lock.unlock();
+
+            response.set_id(fetch->id);
+            fetch->offset += this->service->ReadChunk(fetch->mapped_file, fetch->offset, fetch->end,
+                                                      response.mutable_chunk()->mutable_filechunk());
+            response.set_more(fetch->offset < fetch->end);
+
+            lock.lock();
+            if (response.more())
+            {
+                this->fetches.push_back(std::move(fetch));
+            }
+            this->writing = false;
+            if (!this->broken)
+            {
+                this->queue.push_back(std::move(response));
+            }
+            Continue(lock);
+        }
+
+        /**
+         * Open a fetch and let it take turns on the stream
+         *
+         * @param id
+         * @param get
+         */
+        void StartFetch(std::uint64_t id, const GetRequest &get)
+        {
+            std::unique_ptr<FetchState> fetch(new FetchState());
+            fetch->id = id;
+            SyncResponse response;
+            response.set_id(id);
+            if (IsReservedName(get.filename()))
+            {
+                SetStatus(ReservedNameStatus(), &response);
+                Answer(std::move(response));
+                return;
+            }
+            if (!fetch->mapped_file.Open(this->service->WrapPath(get.filename())))
+            {
+                SetStatus(Status(StatusCode::NOT_FOUND, "The requested file is not found"), &response);
+                Answer(std::move(response));
+                return;
+            }
+            Status range = ResolveRange(fetch->mapped_file, get, &fetch->offset, &fetch->end);
+            if (!range.ok() || fetch->offset >= fetch->end)
+            {
+                // nothing to send, a single empty chunk answers the fetch
+                SetStatus(range, &response);
+                response.mutable_chunk();
+                Answer(std::move(response));
+                return;
+            }
+
+            const std::size_t prefetch_window = DFS_PREFETCH_CHUNKS * DFS_CHUNK_SIZE;
+            fetch->mapped_file.AdviseSequential(fetch->offset, fetch->end - fetch->offset);
+            fetch->mapped_file.Prefetch(fetch->offset, std::min(prefetch_window, fetch->end - fetch->offset));
+
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->pending--;
+            if (!this->broken)
+            {
+                this->fetches.push_back(std::move(fetch));
+            }
+            Continue(lock);
+        }
+
+        /**
+         * Run a stat, lock, delete or list command
+         *
+         * @param command
+         */
+        void RunCommand(const SyncRequest &command)
+        {
+            SyncResponse response;
+            response.set_id(command.id());
+            Status status;
+            switch (command.command_case())
+            {
+            case SyncRequest::kStat:
+                status = this->service->GetStatus(this->context, &command.stat(), response.mutable_stat());
+                break;
+            case SyncRequest::kLock:
+            {
+                LockRequest lock_request = command.lock();
+                lock_request.set_cid(this->cid);
+                status = this->service->GrantLock(this->context, &lock_request, response.mutable_lock());
+                if (status.ok())
+                {
+                    std::lock_guard<std::mutex> lock(this->mutex);
+                    this->locked.insert(lock_request.filename());
+                }
+                break;
+            }
+            case SyncRequest::kRemove:
+            {
+                DeleteResponse delete_response;
+                status = this->service->DeleteFile(this->context, &command.remove(), &delete_response);
+                {
+                    // the delete released the lock
+                    std::lock_guard<std::mutex> lock(this->mutex);
+                    this->locked.erase(command.remove().filename());
+                }
+                break;
+            }
+            case SyncRequest::kList:
+                status = this->service->ListFiles(this->context, &command.list(), response.mutable_list());
+                break;
+            default:
+                status = Status(StatusCode::INVALID_ARGUMENT, "Unknown sync command");
+                break;
+            }
+            SetStatus(status, &response);
+            Answer(std::move(response));
+        }
+
+    public:
+        SyncReactor(DFSServiceImpl *service, CallbackServerContext *context)
+            : service(service), context(context)
+        {
+            {
+                std::lock_guard<std::mutex> lock(this->service->sync_sessions_mutex);
+                this->service->sync_sessions.insert(this);
+            }
+            StartRead(&this->request);
+        }
+
+        /**
+         * Whether the session belongs to a client
+         *
+         * @param cid
+         */
+        bool BelongsTo(const std::string &cid)
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            return this->cid == cid;
+        }
+
+        /**
+         * Push a change notice to the client
+         *
+         * @param notice
+         */
+        void Notify(const ListResponse::FileInfo &notice)
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            if (this->broken || this->finished || this->reads_done)
+            {
+                return;
+            }
+            SyncResponse response;
+            *response.mutable_notice() = notice;
+            this->queue.push_back(std::move(response));
+            Continue(lock);
+        }
+
+        void OnReadDone(bool ok) override
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            if (!ok)
+            {
+                this->reads_done = true;
+                Continue(lock);
+                return;
+            }
+            if (this->cid.empty())
+            {
+                this->cid = this->request.cid();
+            }
+
+            this->pending++;
+            if (this->request.command_case() == SyncRequest::kFetch)
+            {
+                auto command = std::make_shared<SyncRequest>(std::move(this->request));
+                this->service->disk_pool.Post([this, command]
+                                              { StartFetch(command->id(), command->fetch()); });
+            }
+            else
+            {
+                auto command = std::make_shared<SyncRequest>(std::move(this->request));
+                this->service->disk_pool.Post([this, command]
+                                              { RunCommand(*command); });
+            }
+            lock.unlock();
+            StartRead(&this->request);
+        }
+
+        void OnWriteDone(bool ok) override
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            SyncResponse &sent = this->queue.front();
+            if (sent.has_chunk() && sent.code() == StatusCode::OK && this->spare.size() < DFS_SYNC_SPARE_CHUNKS)
+            {
+                this->spare.push_back(std::move(sent));
+            }
+            this->queue.pop_front();
+            this->writing = false;
+            if (!ok)
+            {
+                this->broken = true;
+                this->queue.clear();
+                this->fetches.clear();
+            }
+            Continue(lock);
+        }
+
+        void OnDone() override
+        {
+            delete this;
+        }
+    };
+
+    /**
+     * Receives an upload into a temporary file.
+     *
+     * Each received chunk is written at its offset on the disk pool while the
+     * next one is read from the network. At most DFS_WRITE_QUEUE_DEPTH chunks
+     * are in flight before reading pauses. Once the stream ends and every
+     * write has landed, the upload is committed or discarded on the pool.
+     */
+    class StoreFileReactor : public grpc::ServerReadReactor<StoreRequest>
+    {
+
+    private:
+        DFSServiceImpl *service;
+        CallbackServerContext *context;
+        StoreRequest request;
+
+        std::string filename;
+        std::string temp_path;
+        FileDescriptor fd = -1;
+
+        /** Upload session this stream continues, empty for a one-shot upload **/
+        std::string session_id;
+
+        /** Why the stream was refused before anything was written **/
+        Status rejection = Status::OK;
+
+        /** The stream rebuilds the file from block copies of the current version **/
+        bool delta = false;
+
+        /** The current version a delta upload copies blocks from **/
+        std::shared_ptr<DFSMappedFile> basis;
+
+        /** CRC of the complete file a delta upload must rebuild **/
+        std::uint32_t expected_crc = 0;
+
+        /** Offset of the next received chunk **/
+        off_t offset = 0;
+
+        /** Size the client declared, the temp file is preallocated to it **/
+        off_t declared_size = 0;
+
+        /** The upload is too large to keep in the page cache once written **/
+        bool bypass_cache = false;
+
+        /** Mutex for the transfer state below **/
+        std::mutex mutex;
+
+        /** A StartRead is outstanding **/
+        bool read_pending = false;
+
+        /** The client has finished sending **/
+        bool read_done = false;
+
+        /** A write failed, the rest of the upload is dropped **/
+        bool failed = false;
+
+        /** Commit or discard has been posted **/
+        bool completing = false;
+
+        /** The file is counted in open_stores **/
+        bool counted = false;
+
+        /**
+         * Stop counting the stream in open_stores. Caller holds write_locks_mutex.
+         */
+        void Uncount()
+        {
+            if (this->counted)
+            {
+                this->service->CountOpenStore(this->filename, -1);
+                this->counted = false;
+            }
+        }
+
+        /** Writes posted to the disk pool that have not landed **/
+        int in_flight = 0;
+
+        /**
+         * Decide under the mutex whether to read the next chunk
+         *
+         * @return true if the caller should StartRead once the mutex is released
+         */
+        bool ClaimRead()
+        {
+            if (this->read_pending || this->read_done || this->failed || this->in_flight >= DFS_WRITE_QUEUE_DEPTH)
+            {
+                return false;
+            }
+            this->read_pending = true;
+            return true;
+        }
+
+        /**
+         * Decide under the mutex whether the upload is ready to complete
+         *
+         * @return true if the caller should post Complete
+         */
+        bool ClaimComplete()
+        {
+            if (this->completing || this->read_pending || this->in_flight > 0 || !(this->read_done || this->failed))
+            {
+                return false;
+            }
+            this->completing = true;
+            return true;
+        }
+
+        /**
+         * Post a write of data at offset to the disk pool. Caller holds the mutex.
+         *
+         * @param data
+         * @param size
+         * @param owner keeps data alive until the write lands
+         */
+        void PostWrite(const char *data, std::size_t size, std::shared_ptr<const void> owner)
+        {
+            off_t write_offset = this->offset;
+            this->offset += size;
+            this->in_flight++;
+            this->service->disk_pool.Post([this, data, size, owner, write_offset]
+                                          {
+                bool written = dfs_pwrite_all(this->fd, data, size, write_offset);
+
+                // write back and drop the window before the one this chunk finished,
+                // leaving the writes still in flight alone
+                off_t window = (write_offset + size) / DFS_BYPASS_CACHE_WINDOW;
+                if (written && this->bypass_cache && window >= 2 &&
+                    window != write_offset / DFS_BYPASS_CACHE_WINDOW)
+                {
+                    dfs_drop_written(this->fd, (window - 2) * DFS_BYPASS_CACHE_WINDOW, DFS_BYPASS_CACHE_WINDOW);
+                }
+
+                std::unique_lock<std::mutex> lock(this->mutex);
+                this->in_flight--;
+                this->failed = this->failed || !written;
+                bool read = ClaimRead();
+                bool complete = ClaimComplete();
+                lock.unlock();
+                Continue(read, complete); });
+        }
+
+        void Continue(bool read, bool complete)
+        {
+            if (read)
+            {
+                StartRead(&this->request);
+            }
+            if (complete)
+            {
+                this->service->disk_pool.Post([this]
+                                              { Complete(); });
+            }
+        }
+
+        void Complete()
+        {
+            bool interrupted = this->context->IsCancelled();
+
+            // An interrupted session keeps what it wrote and its write lock for the resume
+            if (interrupted && !this->failed && !this->session_id.empty() && fdatasync(this->fd) == 0)
+            {
+                close(this->fd);
+                this->service->DetachUploadSession(this->session_id, this->offset);
+                {
+                    std::lock_guard<std::mutex> lock(this->service->write_locks_mutex);
+                    Uncount();
+                }
+                Finish(Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded, the upload can be resumed"));
+                return;
+            }
+
+            Status status = Status::OK;
+            if (interrupted)
+            {
+                this->service->DiscardUpload(this->fd, this->temp_path);
+                status = Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded");
+            }
+            else if (!this->rejection.ok())
+            {
+                this->service->DiscardUpload(this->fd, this->temp_path);
+                status = this->rejection;
+            }
+            else if (this->failed)
+            {
+                this->service->DiscardUpload(this->fd, this->temp_path);
+                status = Status(StatusCode::CANCELLED, "The file could not be stored");
+            }
+            else if (this->declared_size > this->offset && ftruncate(this->fd, this->offset) != 0)
+            {
+                // the client sent less than it declared, drop the unused preallocation
+                this->service->DiscardUpload(this->fd, this->temp_path);
+                status = Status(StatusCode::CANCELLED, "The file could not be stored");
+            }
+            else if (this->delta && dfs_file_checksum(this->temp_path, &this->service->crc_table) != this->expected_crc)
+            {
+                // a weak checksum collision or a basis that changed underneath the client
+                this->service->DiscardUpload(this->fd, this->temp_path);
+                status = Status(StatusCode::DATA_LOSS, "The rebuilt file does not match the client's copy");
+            }
+            else if (this->fd >= 0 && !this->service->CommitUpload(this->fd, this->temp_path, this->filename,
+                                                                   this->bypass_cache))
+            {
+                status = Status(StatusCode::CANCELLED, "The file could not be stored");
+            }
+
+            if (!this->session_id.empty())
+            {
+                this->service->CloseUploadSession(this->session_id);
+            }
+            {
+                std::lock_guard<std::mutex> lock(this->service->write_locks_mutex);
+                // releasing the lock
+                Uncount();
+                this->service->write_locks.erase(this->filename);
+            }
+            Finish(status);
+        }
 
-    /** The mount path for the server **/
-    std::string mount_path;
+    public:
+        StoreFileReactor(DFSServiceImpl *service, CallbackServerContext *context)
+            : service(service), context(context)
+        {
+            this->read_pending = true;
+            StartRead(&this->request);
+        }
 
-    /** Mutex for managing the queue requests **/
-    std::mutex queue_mutex;
+        void OnReadDone(bool ok) override
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->read_pending = false;
+            if (!ok || this->failed)
+            {
+                // the client finished sending or went away
+                this->read_done = this->read_done || !ok;
+                bool complete = ClaimComplete();
+                lock.unlock();
+                Continue(false, complete);
+                return;
+            }
 
-    /** Mutex for write locks map **/
-    std::mutex write_locks_mutex;
+            // stage the new content next to the existing file
+            if (this->fd < 0)
+            {
+                if (IsReservedName(this->request.filename()))
+                {
+                    this->filename = this->request.filename();
+                    this->rejection = ReservedNameStatus();
+                }
+                else if (this->request.delta())
+                {
+                    // delta uploads are one-shot and need the version the client diffed against
+                    this->filename = this->request.filename();
+                    this->delta = true;
+                    this->expected_crc = this->request.crc();
+                    this->basis = std::make_shared<DFSMappedFile>();
+                    if (!this->request.session_id().empty())
+                    {
+                        this->rejection = Status(StatusCode::INVALID_ARGUMENT, "Delta uploads cannot be resumed");
+                    }
+                    else if (!this->basis->Open(this->service->WrapPath(this->filename)))
+                    {
+                        this->rejection = Status(StatusCode::FAILED_PRECONDITION, "There is no stored file to apply the delta to");
+                    }
+                    else
+                    {
+                        this->temp_path = this->service->UploadTemplate(this->filename);
+                        this->fd = mkostemp(&this->temp_path[0], O_CLOEXEC);
+                    }
+                }
+                else if (this->request.session_id().empty())
+                {
+                    this->filename = this->request.filename();
+                    this->temp_path = this->service->UploadTemplate(this->filename);
+                    this->fd = mkostemp(&this->temp_path[0], O_CLOEXEC);
+                }
+                else if (this->service->AttachUploadSession(this->request.session_id(), this->request.offset(),
+                                                            &this->filename, &this->temp_path))
+                {
+                    // continue the session, dropping anything past the durable offset
+                    this->session_id = this->request.session_id();
+                    this->offset = this->request.offset();
+                    this->fd = open(this->temp_path.c_str(), O_WRONLY | O_CLOEXEC);
+                    if (this->fd >= 0 && ftruncate(this->fd, this->offset) != 0)
+                    {
+                        close(this->fd);
+                        this->fd = -1;
+                    }
+                }
+                else
+                {
+                    this->rejection = Status(StatusCode::NOT_FOUND, "The upload session is unknown");
+                }
 
-    /** Map for server to track which client holds lock **/
-    std::unordered_map<std::string, std::string> write_locks;
+                // a sync session that ends meanwhile leaves the lock to this stream
+                if (this->rejection.ok() && !this->filename.empty())
+                {
+                    std::lock_guard<std::mutex> locks_lock(this->service->write_locks_mutex);
+                    this->service->CountOpenStore(this->filename, 1);
+                    this->counted = true;
+                }
 
-    /** The vector of queued tags used to manage asynchronous requests **/
-    std::vector<QueueRequest<FileRequestType, FileListResponseType>> queued_tags;
+                if (this->fd < 0)
+                {
+                    this->failed = true;
+                    bool complete = ClaimComplete();
+                    lock.unlock();
+                    Continue(false, complete);
+                    return;
+                }
+                // reserve the rest of the file in one go instead of growing it chunk by chunk
+                if (this->request.size() > this->offset &&
+                    fallocate(this->fd, 0, this->offset, this->request.size() - this->offset) == 0)
+                {
+                    this->declared_size = this->request.size();
+                }
+                this->bypass_cache = DFS_BYPASS_CACHE_MIN_FILE > 0 && this->request.size() >= DFS_BYPASS_CACHE_MIN_FILE;
+                std::cout << "Server: storing the file: " << this->filename << std::endl;
+            }
 
-    /**
-     * Prepend the mount path to the filename.
-     *
-     * @param filepath
-     * @return
-     */
-    const std::string WrapPath(const std::string &filepath)
-    {
-        return this->mount_path + filepath;
-    }
+            // a delta message copies a range of the current version ahead of its literal bytes
+            if (this->delta && this->request.copy_length() > 0)
+            {
+                std::int64_t copy_offset = this->request.copy_offset();
+                std::int64_t copy_length = this->request.copy_length();
+                if (copy_offset < 0 || static_cast<std::uint64_t>(copy_offset + copy_length) > this->basis->Size())
+                {
+                    this->rejection = Status(StatusCode::INVALID_ARGUMENT, "The delta copies past the end of the stored file");
+                    this->failed = true;
+                    bool complete = ClaimComplete();
+                    lock.unlock();
+                    Continue(false, complete);
+                    return;
+                }
+                PostWrite(this->basis->Data() + copy_offset, copy_length, this->basis);
+            }
+
+            // hand the chunk to the disk pool and go back to the network
+            auto chunk = std::make_shared<std::string>(std::move(*this->request.mutable_filechunk()));
+            PostWrite(chunk->data(), chunk->size(), chunk);
+
+            bool read = ClaimRead();
+            lock.unlock();
+            Continue(read, false);
+        }
+
+        void OnDone() override
+        {
+            delete this;
+        }
+    };
 
     /** CRC Table kept in memory for faster calculations **/
     CRC::Table<std::uint32_t, 32> crc_table;
 
+    /** Compression level of the file chunks sent by DFSGetFile **/
+    std::atomic<grpc_compression_level> compression_level;
+
+    /** Mutex for the compressibility verdicts **/
+    std::mutex compressible_mutex;
+
+    /** Whether each file is worth compressing, keyed by inode with the mtime it was sampled at **/
+    std::unordered_map<ino_t, std::pair<std::int64_t, bool>> compressible_files;
+
+    /** Arenas for the messages of DFSList and DFSStatus calls **/
+    DFSArenaAllocator<ListRequest, ListResponse> list_allocator;
+    DFSArenaAllocator<StatusRequest, StatusResponse> status_allocator;
+
+    /** Runs the disk work of every RPC, declared last so it drains before the rest is torn down **/
+    DFSWorkerPool disk_pool;
+
 public:
-    DFSServiceImpl(const std::string &mount_path, const std::string &server_address, int num_async_threads) : mount_path(mount_path), crc_table(CRC::CRC_32())
+    DFSServiceImpl(const std::string &mount_path, const std::string &server_address, int num_async_threads,
+                   grpc_compression_level compression_level) : mount_path(mount_path),
+                                                               block_cache(DFS_BLOCK_CACHE_BYTES),
+                                                               crc_table(CRC::CRC_32()),
+                                                               compression_level(compression_level),
+                                                               list_allocator(DFS_ARENA_START_BLOCK, DFS_ARENA_MAX_BLOCK),
+                                                               status_allocator(DFS_ARENA_START_BLOCK, DFS_ARENA_MAX_BLOCK),
+                                                               disk_pool(DFS_DISK_THREADS)
     {
+        RemoveStaleUploads();
+        LoadBlobs();
+        LoadMetadata();
+        CompactNameTimes();
+        WatchMount();
+
+        this->SetMessageAllocatorFor_DFSList(&this->list_allocator);
+        this->SetMessageAllocatorFor_DFSStatus(&this->status_allocator);
 
         this->runner.SetService(this);
         this->runner.SetAddress(server_address);
@@ -97,6 +3202,11 @@ public:
     ~DFSServiceImpl()
     {
         this->runner.Shutdown();
+        StopWatch();
+        if (this->name_times_fd >= 0)
+        {
+            close(this->name_times_fd);
+        }
     }
 
     void Run()
@@ -104,6 +3214,17 @@ public:
         this->runner.Run();
     }
 
+    /**
+     * Change the compression level of the file chunks sent by DFSGetFile,
+     * applies to the fetches that start afterwards
+     *
+     * @param level
+     */
+    void SetCompressionLevel(grpc_compression_level level)
+    {
+        this->compression_level.store(level, std::memory_order_relaxed);
+    }
+
     /**
      * Request callback for asynchronous requests
      *
@@ -143,24 +3264,7 @@ public:
     void ProcessCallback(ServerContext *context, FileRequestType *request, FileListResponseType *response)
     {
         std::cout << "Begin ProcessCallback" << std::endl;
-        DIR *dir = opendir(mount_path.c_str());
-        struct dirent *entry;
-        while ((entry = readdir(dir)) != NULL)
-        {
-            if (entry->d_type == DT_REG)
-            {
-                std::cout << "Regular file detected: " << entry->d_name << std::endl;
-                auto *fileinfo = response->add_fileinfo();
-                fileinfo->set_filename(entry->d_name);
-
-                struct stat filestat;
-                if (stat(WrapPath(entry->d_name).c_str(), &filestat) == 0)
-                {
-                    fileinfo->set_mtime(filestat.st_mtime);
-                }
-            }
-        }
-        closedir(dir);
+        ListMetadata(response);
         std::cout << "End ProcessCallback" << std::endl;
     }
 
@@ -197,63 +3301,53 @@ public:
     /**
      * @brief Lists all files available on the server.
      */
-    Status DFSList(ServerContext *context,
-                   const ListRequest *request,
-                   ListResponse *response) override
+    Status ListFiles(grpc::ServerContextBase *context,
+                     const ListRequest *request,
+                     ListResponse *response)
     {
         if (context->IsCancelled())
         {
             return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded");
         }
 
-        DIR *dir = opendir(mount_path.c_str());
-        struct dirent *entry;
-        while ((entry = readdir(dir)) != NULL)
-        {
-            if (entry->d_type == DT_REG)
-            {
-                auto *fileinfo = response->add_fileinfo();
-                fileinfo->set_filename(entry->d_name);
-
-                struct stat filestat;
-                if (stat(WrapPath(entry->d_name).c_str(), &filestat) == 0)
-                {
-                    fileinfo->set_mtime(filestat.st_mtime);
-                }
-                else
-                {
-                    return Status(StatusCode::CANCELLED, "Error listing files");
-                }
-            }
-        }
-        closedir(dir);
+        ListMetadata(response);
         return Status::OK;
     }
 
     /**
      * @brief Get file status from the server.
      */
-    Status DFSStatus(ServerContext *context,
+    Status GetStatus(grpc::ServerContextBase *context,
                      const StatusRequest *request,
-                     StatusResponse *response) override
+                     StatusResponse *response)
     {
         std::string filename = request->filename();
         if (context->IsCancelled())
         {
             return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded");
         }
+        if (IsReservedName(filename))
+        {
+            return ReservedNameStatus();
+        }
 
-        struct stat filestat;
-        if (stat(WrapPath(filename).c_str(), &filestat) == 0)
+        FileMetadata entry;
+        if (LookupMetadata(filename, &entry))
         {
             // file found
             response->set_filename(filename);
-            response->set_size(filestat.st_size);
-            response->set_mtime(filestat.st_mtime);
-            response->set_ctime(filestat.st_ctime);
+            response->set_size(entry.size);
+            response->set_mtime(entry.mtime);
+            response->set_ctime(entry.ctime);
+
+            // small files go back whole, checksummed from memory
+            if (ReadInline(filename, entry.size, response))
+            {
+                return Status::OK;
+            }
 
-            std::uint32_t server_crc = dfs_file_checksum(WrapPath(filename), &this->crc_table);
-            response->set_crc(server_crc);
+            // the checksum is read once per version of the file
+            response->set_crc(MetadataChecksum(filename, entry));
 
             return Status::OK;
         }
@@ -265,44 +3359,33 @@ public:
     }
 
     /**
-     * @brief Fetch file content from the server.
+     * Take the write lock of a file if it is free or already held by the client.
+     * Caller holds write_locks_mutex.
+     *
+     * @param filename
+     * @param cid
+     * @return false if another client holds it
      */
-    Status DFSGetFile(ServerContext *context,
-                      const dfs_service::GetRequest *request,
-                      ServerWriter<GetResponse> *writer) override
+    bool TakeWriteLock(const std::string &filename, const std::string &cid)
     {
-        std::string filename = request->filename();
-        std::ifstream filestream(WrapPath(filename), std::ios::binary);
-
-        // Check if file exist. If not, return status message
-        if (!filestream.is_open())
-        {
-            return Status(StatusCode::NOT_FOUND, "The requested file is not found");
-        }
-
-        // Send file data in chunks
-        char buffer[256];
-        while (!filestream.eof())
+        std::string &holder = write_locks[filename];
+        if (holder.empty() || holder == cid)
         {
-            // Continously check if deadline exceed
-            if (context->IsCancelled())
-            {
-                return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded");
-            }
-            filestream.read(buffer, sizeof(buffer));
-            GetResponse response;
-            response.set_filechunk(buffer, filestream.gcount());
-            writer->Write(response);
+            holder = cid;
+            return true;
         }
-        return Status::OK;
+        return false;
     }
 
     /**
      * @brief Request lock from the server.
+     *
+     * A lock held by another client may belong to an abandoned upload session,
+     * so expired sessions are dropped before the request is refused.
      */
-    Status DFSRequestLock(ServerContext *context,
-                          const LockRequest *request,
-                          LockResponse *response) override
+    Status GrantLock(grpc::ServerContextBase *context,
+                     const LockRequest *request,
+                     LockResponse *response)
     {
         std::string filename = request->filename();
         std::string cid = request->cid();
@@ -310,13 +3393,26 @@ public:
         {
             return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded");
         }
+        if (IsReservedName(filename))
+        {
+            return ReservedNameStatus();
+        }
 
+        {
+            std::lock_guard<std::mutex> lock(write_locks_mutex);
+            if (TakeWriteLock(filename, cid))
+            {
+                response->set_locked(true);
+                return Status::OK;
+            }
+        }
+
+        std::lock_guard<std::mutex> sessions_lock(upload_sessions_mutex);
+        ExpireUploadSessions();
         std::lock_guard<std::mutex> lock(write_locks_mutex);
-        // critical section
-        if (write_locks[filename] == "" || write_locks[filename] == cid)
+        if (TakeWriteLock(filename, cid))
         {
             // grant access
-            write_locks[filename] = cid;
             response->set_locked(true);
             return Status::OK;
         }
@@ -326,60 +3422,20 @@ public:
             response->set_locked(false);
             return Status(StatusCode::RESOURCE_EXHAUSTED, "write lock cannot be obtained");
         }
-
-        // mutex unlock
-    }
-
-    /**
-     * @brief Store file content to the server.
-     */
-    Status DFSStoreFile(ServerContext *context,
-                        ServerReader<StoreRequest> *reader,
-                        StoreResponse *response) override
-    {
-        StoreRequest request;
-        bool new_file = true;
-
-        std::string filename;
-        std::ofstream stored_file;
-        while (reader->Read(&request))
-        {
-            // Continously check if deadline exceed
-            if (context->IsCancelled())
-            {
-                std::lock_guard<std::mutex> lock(write_locks_mutex);
-                // releasing the lock
-                write_locks.erase(filename);
-                return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded");
-            }
-
-            // replace existing file content
-            if (new_file)
-            {
-                filename = request.filename();
-                stored_file.open(WrapPath(filename), std::ios::binary);
-                new_file = false;
-            }
-            std::cout << "Server: storing the file: " << filename << std::endl;
-
-            stored_file.write(request.filechunk().data(), request.filechunk().size());
-        }
-
-        std::lock_guard<std::mutex> lock(write_locks_mutex);
-        // releasing the lock
-        write_locks.erase(filename);
-
-        return Status::OK;
     }
 
     /**
      * @brief Delete file from the server.
      */
-    Status DFSDeleteFile(ServerContext *context,
-                         const DeleteRequest *request,
-                         DeleteResponse *response) override
+    Status DeleteFile(grpc::ServerContextBase *context,
+                      const DeleteRequest *request,
+                      DeleteResponse *response)
     {
         std::string filename = request->filename();
+        if (IsReservedName(filename))
+        {
+            return ReservedNameStatus();
+        }
 
         std::lock_guard<std::mutex> lock(write_locks_mutex);
         if (context->IsCancelled())
@@ -389,9 +3445,17 @@ public:
             return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded");
         }
 
+        InvalidateCachedFile(filename);
+        struct stat filestat;
+        bool stored = stat(WrapPath(filename).c_str(), &filestat) == 0;
         if (std::remove(WrapPath(filename).c_str()) == 0)
         {
             // file deleted
+            if (stored)
+            {
+                ReleaseBlob(filestat);
+            }
+            RefreshMetadata(filename);
             // releasing the lock
             write_locks.erase(filename);
             return Status::OK;
@@ -403,6 +3467,189 @@ public:
             return Status(StatusCode::CANCELLED, "Something happened");
         }
     }
+
+    ServerUnaryReactor *DFSList(CallbackServerContext *context,
+                                const ListRequest *request,
+                                ListResponse *response) override
+    {
+        return RunOnDiskPool(context, [=]
+                             { return this->ListFiles(context, request, response); });
+    }
+
+    ServerUnaryReactor *DFSStatus(CallbackServerContext *context,
+                                  const StatusRequest *request,
+                                  StatusResponse *response) override
+    {
+        return RunOnDiskPool(context, [=]
+                             { return this->GetStatus(context, request, response); });
+    }
+
+    /**
+     * @brief Fetch file content from the server.
+     */
+    grpc::ServerWriteReactor<GetResponse> *DFSGetFile(CallbackServerContext *context,
+                                                      const GetRequest *request) override
+    {
+        return new GetFileReactor(this, context, request);
+    }
+
+    grpc::ServerWriteReactor<GetFilesResponse> *DFSGetFiles(CallbackServerContext *context,
+                                                            const GetFilesRequest *request) override
+    {
+        return new GetFilesReactor(this, context, request);
+    }
+
+    ServerUnaryReactor *DFSRequestLock(CallbackServerContext *context,
+                                       const LockRequest *request,
+                                       LockResponse *response) override
+    {
+        // the lock table lives in memory, no need to leave the callback thread
+        ServerUnaryReactor *reactor = context->DefaultReactor();
+        reactor->Finish(GrantLock(context, request, response));
+        return reactor;
+    }
+
+    /**
+     * @brief Store file content to the server.
+     *
+     * The upload is staged in a temporary file in the mount and renamed over the
+     * stored file once complete, so readers never see a partial file and a
+     * cancelled upload leaves the previous version untouched.
+     */
+    grpc::ServerReadReactor<StoreRequest> *DFSStoreFile(CallbackServerContext *context,
+                                                        StoreResponse *response) override
+    {
+        return new StoreFileReactor(this, context);
+    }
+
+    grpc::ServerBidiReactor<SyncRequest, SyncResponse> *DFSSync(CallbackServerContext *context) override
+    {
+        return new SyncReactor(this, context);
+    }
+
+    grpc::ServerReadReactor<StoreFilesRequest> *DFSStoreFiles(CallbackServerContext *context,
+                                                              StoreFilesResponse *response) override
+    {
+        return new StoreFilesReactor(this, context, response);
+    }
+
+    /**
+     * @brief Open an upload session, or report how far an existing one got.
+     *
+     * A new session requires the caller to hold the write lock for the file.
+     * The session keeps that lock until the upload completes or the session
+     * expires, so a resumed upload does not need to request it again.
+     */
+    Status OpenUpload(grpc::ServerContextBase *context,
+                      const UploadRequest *request,
+                      UploadResponse *response)
+    {
+        if (context->IsCancelled())
+        {
+            return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded");
+        }
+        if (IsReservedName(request->filename()))
+        {
+            return ReservedNameStatus();
+        }
+
+        std::lock_guard<std::mutex> lock(upload_sessions_mutex);
+        ExpireUploadSessions();
+
+        // resume
+        if (!request->session_id().empty())
+        {
+            auto session = this->upload_sessions.find(request->session_id());
+            if (session == this->upload_sessions.end() || session->second.attached ||
+                session->second.filename != request->filename() || session->second.cid != request->cid())
+            {
+                return Status(StatusCode::NOT_FOUND, "The upload session is unknown");
+            }
+            session->second.touched = std::chrono::steady_clock::now();
+            response->set_session_id(request->session_id());
+            response->set_offset(session->second.committed);
+            return Status::OK;
+        }
+
+        {
+            std::lock_guard<std::mutex> locks_lock(write_locks_mutex);
+            auto holder = write_locks.find(request->filename());
+            if (holder == write_locks.end() || holder->second != request->cid())
+            {
+                return Status(StatusCode::RESOURCE_EXHAUSTED, "write lock is not held");
+            }
+        }
+
+        UploadSession session;
+        session.filename = request->filename();
+        session.cid = request->cid();
+        session.temp_path = UploadTemplate(session.filename);
+        FileDescriptor fd = mkostemp(&session.temp_path[0], O_CLOEXEC);
+        if (fd < 0)
+        {
+            return Status(StatusCode::CANCELLED, "The upload could not be staged");
+        }
+        close(fd);
+        session.touched = std::chrono::steady_clock::now();
+
+        std::string session_id = NewSessionId();
+        this->upload_sessions[session_id] = session;
+        response->set_session_id(session_id);
+        response->set_offset(0);
+        return Status::OK;
+    }
+
+    ServerUnaryReactor *DFSOpenUpload(CallbackServerContext *context,
+                                      const UploadRequest *request,
+                                      UploadResponse *response) override
+    {
+        return RunOnDiskPool(context, [=]
+                             { return this->OpenUpload(context, request, response); });
+    }
+
+    /**
+     * @brief Compute the block signatures of a stored file for a delta upload.
+     *
+     * Each full block gets the rolling checksum the client scans its copy with
+     * and a CRC to confirm a match. A trailing partial block is left out and
+     * always travels as literal data.
+     */
+    Status GetSignatures(grpc::ServerContextBase *context,
+                         const SignatureRequest *request,
+                         SignatureResponse *response)
+    {
+        if (IsReservedName(request->filename()))
+        {
+            return ReservedNameStatus();
+        }
+        DFSMappedFile mapped_file;
+        if (!mapped_file.Open(WrapPath(request->filename())))
+        {
+            return Status(StatusCode::NOT_FOUND, "The requested file is not found");
+        }
+
+        std::size_t block_size = dfs_delta_block_size(mapped_file.Size());
+        response->set_block_size(block_size);
+        dfs_block_signatures(mapped_file.Data(), mapped_file.Size(), block_size,
+                             &this->crc_table, response->mutable_signature());
+        return Status::OK;
+    }
+
+    ServerUnaryReactor *DFSGetSignatures(CallbackServerContext *context,
+                                         const SignatureRequest *request,
+                                         SignatureResponse *response) override
+    {
+        return RunOnDiskPool(context, [=]
+                             { return this->GetSignatures(context, request, response); });
+    }
+
+    ServerUnaryReactor *DFSDeleteFile(CallbackServerContext *context,
+                                      const DeleteRequest *request,
+                                      DeleteResponse *response) override
+    {
+        return RunOnDiskPool(context, [=]
+                             { return this->DeleteFile(context, request, response); });
+    }
 };
 
 /**
@@ -416,7 +3663,11 @@ DFSServerNode::DFSServerNode(const std::string &server_address,
                              std::function<void()> callback) : server_address(server_address),
                                                                mount_path(mount_path),
                                                                num_async_threads(num_async_threads),
-                                                               grader_callback(callback) {}
+                                                               grader_callback(callback)
+{
+    dfs_env_compression_level(&this->compression_level);
+}
+
 /**
  * Server shutdown
  */
@@ -425,13 +3676,36 @@ DFSServerNode::~DFSServerNode() noexcept
     dfs_log(LL_SYSINFO) << "DFSServerNode shutting down";
 }
 
+/**
+ * Set the compression level of the file chunks sent to clients,
+ * a running server applies it to the fetches that start afterwards
+ *
+ * @param level
+ */
+void DFSServerNode::SetCompressionLevel(grpc_compression_level level)
+{
+    std::lock_guard<std::mutex> lock(this->service_mutex);
+    this->compression_level = level;
+    if (this->service != nullptr)
+    {
+        this->service->SetCompressionLevel(level);
+    }
+}
+
 /**
  * Start the DFSServerNode server
  */
 void DFSServerNode::Start()
 {
-    DFSServiceImpl service(this->mount_path, this->server_address, this->num_async_threads);
+    std::unique_lock<std::mutex> lock(this->service_mutex);
+    DFSServiceImpl service(this->mount_path, this->server_address, this->num_async_threads,
+                           this->compression_level);
+    this->service = &service;
+    lock.unlock();
 
     dfs_log(LL_SYSINFO) << "DFSServerNode server listening on " << this->server_address;
     service.Run();
+
+    lock.lock();
+    this->service = nullptr;
 }
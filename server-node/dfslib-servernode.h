@@ -4,12 +4,146 @@
 #include <string>
 #include <iostream>
 #include <thread>
+#include <mutex>
 #include <grpcpp/grpcpp.h>
 
+/** Prefix of the temporary files uploads are staged in before being renamed into place **/
+#define DFS_TEMP_PREFIX ".dfs-upload-"
+
+/** Directory under the mount path holding the content-addressed blobs **/
+#define DFS_BLOB_DIR ".dfs-blobs/"
+
+/** Journal in the blob directory keeping the commit time of each name that shares a blob **/
+#define DFS_NAME_TIMES "mtimes"
+
+/**
+ * Store each distinct content once as a blob named by its checksum and size.
+ * Stored files are hard links to their blob, so identical uploads share one
+ * copy on disk and DFSStatus answers with the checksum without reading the file.
+ */
+#ifndef DFS_CONTENT_ADDRESSED
+#define DFS_CONTENT_ADDRESSED 0
+#endif
+
+/**
+ * Shard stored files into two levels of directories named by a hash of the
+ * filename, and list them from an in-memory index instead of reading the
+ * directories. Clients still see one flat namespace.
+ */
+#ifndef DFS_FANOUT
+#define DFS_FANOUT 0
+#endif
+
+/** Extended attribute a file's checksum is kept in, with the inode, size and mtime it was taken at **/
+#ifndef DFS_CHECKSUM_XATTR
+#define DFS_CHECKSUM_XATTR "user.dfs.crc"
+#endif
+
+/** How durable a stored file is before DFSStoreFile returns **/
+enum DFSSyncPolicy {
+    DFS_SYNC_NONE,      // rename only, the page cache flushes in its own time
+    DFS_SYNC_FDATASYNC, // fdatasync the file before and the directory after the rename
+    DFS_SYNC_GROUP      // batch concurrent uploads into shared syncfs calls, before and after the rename
+};
+
+#ifndef DFS_SYNC_POLICY
+#define DFS_SYNC_POLICY DFS_SYNC_FDATASYNC
+#endif
+
+/** How long a group commit waits for other uploads to join the batch **/
+#ifndef DFS_GROUP_COMMIT_WINDOW_MS
+#define DFS_GROUP_COMMIT_WINDOW_MS 5
+#endif
+
+/** Number of chunks DFSGetFile keeps in flight from disk ahead of the one being sent **/
+#ifndef DFS_PREFETCH_CHUNKS
+#define DFS_PREFETCH_CHUNKS 4
+#endif
+
+/** How much of a range fetch the kernel is asked to read ahead when the range is opened **/
+#ifndef DFS_RANGE_READAHEAD
+#define DFS_RANGE_READAHEAD (16 * 1024 * 1024)
+#endif
+
+/** Memory cap of the block cache serving hot files **/
+#ifndef DFS_BLOCK_CACHE_BYTES
+#define DFS_BLOCK_CACHE_BYTES (64 * 1024 * 1024)
+#endif
+
+/** Files larger than this bypass the block cache so bulk reads don't evict hot files **/
+#ifndef DFS_BLOCK_CACHE_MAX_FILE
+#define DFS_BLOCK_CACHE_MAX_FILE (4 * 1024 * 1024)
+#endif
+
+/** Number of received chunks DFSStoreFile may have in flight to the disk **/
+#ifndef DFS_WRITE_QUEUE_DEPTH
+#define DFS_WRITE_QUEUE_DEPTH 4
+#endif
+
+/** Number of chunks DFSGetFile lets gRPC buffer and send as one transport write **/
+#ifndef DFS_WRITE_BATCH_CHUNKS
+#define DFS_WRITE_BATCH_CHUNKS 4
+#endif
+
+/** How long an interrupted upload session is kept for the client to resume it **/
+#ifndef DFS_UPLOAD_SESSION_TTL_MS
+#define DFS_UPLOAD_SESSION_TTL_MS (10 * 60 * 1000)
+#endif
+
+/** Number of threads doing the blocking disk work of all RPCs **/
+#ifndef DFS_DISK_THREADS
+#define DFS_DISK_THREADS 8
+#endif
+
+/**
+ * Compression level DFSGetFile asks gRPC for. gRPC picks the strongest algorithm
+ * at that level that the client advertised, so old clients still get plain chunks.
+ * DFS_COMPRESSION_LEVEL_ENV overrides it when the node is created.
+ */
+#ifndef DFS_SERVER_COMPRESSION_LEVEL
+#define DFS_SERVER_COMPRESSION_LEVEL GRPC_COMPRESS_LEVEL_NONE
+#endif
+
+/** Number of files whose compressibility verdict is remembered **/
+#ifndef DFS_COMPRESSIBLE_CACHE_FILES
+#define DFS_COMPRESSIBLE_CACHE_FILES 4096
+#endif
+
+/** Files up to this size are sent whole in DFSStatus responses and change notices **/
+#ifndef DFS_INLINE_MAX_FILE
+#define DFS_INLINE_MAX_FILE (4 * 1024)
+#endif
+
+/** Files at least this large are streamed without keeping them in the page cache, 0 disables it **/
+#ifndef DFS_BYPASS_CACHE_MIN_FILE
+#define DFS_BYPASS_CACHE_MIN_FILE (256 * 1024 * 1024)
+#endif
+
+/** How much of an upload that bypasses the page cache is written back and dropped at a time **/
+#ifndef DFS_BYPASS_CACHE_WINDOW
+#define DFS_BYPASS_CACHE_WINDOW (8 * 1024 * 1024)
+#endif
+
+/** First and largest arena block of a DFSList or DFSStatus call, the list entries are carved from it **/
+#ifndef DFS_ARENA_START_BLOCK
+#define DFS_ARENA_START_BLOCK (64 * 1024)
+#endif
+
+#ifndef DFS_ARENA_MAX_BLOCK
+#define DFS_ARENA_MAX_BLOCK (1024 * 1024)
+#endif
+
+/** Number of sent fetch chunks a sync session keeps to refill instead of allocating new ones **/
+#ifndef DFS_SYNC_SPARE_CHUNKS
+#define DFS_SYNC_SPARE_CHUNKS 4
+#endif
+
 /**
  * DFSService is used to start up and run the DFSServiceImpl
  * based on the protobuf service created in `dfs-service.proto`.
  */
+class DFSServiceImpl;
+
 class DFSServerNode {
 
 private:
@@ -28,6 +162,15 @@ private:
     /** Server callback **/
     std::function<void()> grader_callback;
 
+    /** Compression level of the file chunks sent to clients **/
+    grpc_compression_level compression_level = DFS_SERVER_COMPRESSION_LEVEL;
+
+    /** Mutex for the running service and the compression level handed to it **/
+    std::mutex service_mutex;
+
+    /** The service while Start is running, so settings can reach it **/
+    DFSServiceImpl *service = nullptr;
+
 public:
     DFSServerNode(const std::string& server_address,
         const std::string& mount_path,
@@ -36,6 +179,7 @@ public:
     ~DFSServerNode();
     void Shutdown();
     void Start();
+    void SetCompressionLevel(grpc_compression_level level);
 };
 
 #endif
@@ -1,7 +1,15 @@
 #include <string>
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
 #include <iostream>
 #include <fstream>
 #include <cstddef>
+#include <cstdlib>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include "dfslib-shared.h"
@@ -13,3 +21,299 @@
 // This shouldn't be changed at the file level.
 dfs_log_level_e DFS_LOG_LEVEL = LL_ERROR;
 
+
+bool dfs_pwrite_all(FileDescriptor fd, const char *data, std::size_t size, off_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t written = pwrite(fd, data, size, offset);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+    return true;
+}
+
+void dfs_drop_written(FileDescriptor fd, off_t offset, off_t length)
+{
+    // dirty pages are skipped by DONTNEED, so write them back first
+    sync_file_range(fd, offset, length,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(fd, offset, length, POSIX_FADV_DONTNEED);
+}
+
+void DFSRollingChecksum::Reset(const char *data, std::size_t size)
+{
+    this->a = 0;
+    this->b = 0;
+    this->size = static_cast<std::uint32_t>(size);
+    for (std::size_t i = 0; i < size; i++)
+    {
+        unsigned char byte = static_cast<unsigned char>(data[i]);
+        this->a += byte;
+        this->b += static_cast<std::uint32_t>(size - i) * byte;
+    }
+    this->a &= 0xffff;
+    this->b &= 0xffff;
+}
+
+void DFSRollingChecksum::Roll(unsigned char out, unsigned char in)
+{
+    this->a = (this->a - out + in) & 0xffff;
+    this->b = (this->b - this->size * out + this->a) & 0xffff;
+}
+
+std::size_t dfs_delta_block_size(std::size_t file_size)
+{
+    std::size_t block_size = static_cast<std::size_t>(std::sqrt(static_cast<double>(file_size)));
+    block_size = std::max<std::size_t>(block_size, (file_size + DFS_DELTA_MAX_BLOCKS - 1) / DFS_DELTA_MAX_BLOCKS);
+    block_size = std::max<std::size_t>(block_size, DFS_DELTA_MIN_BLOCK);
+
+    // round up to a whole KiB
+    return (block_size + 1023) / 1024 * 1024;
+}
+
+void dfs_block_signatures(const char *data, std::size_t size, std::size_t block_size,
+                          CRC::Table<std::uint32_t, 32> *crc_table, DFSBlockSignatures *signatures)
+{
+    for (std::size_t offset = 0; offset + block_size <= size; offset += block_size)
+    {
+        DFSRollingChecksum rolling;
+        rolling.Reset(data + offset, block_size);
+        auto *signature = signatures->Add();
+        signature->set_weak(rolling.Value());
+        signature->set_strong(CRC::Calculate(data + offset, block_size, *crc_table));
+    }
+}
+
+std::vector<DFSDeltaOp> dfs_compute_delta(const char *data, std::size_t size, std::size_t block_size,
+                                          const DFSBlockSignatures &signatures,
+                                          CRC::Table<std::uint32_t, 32> *crc_table)
+{
+    std::vector<DFSDeltaOp> ops;
+    auto add_op = [&ops](bool copy, std::int64_t offset, std::int64_t length)
+    {
+        if (length <= 0)
+        {
+            return;
+        }
+        if (!ops.empty() && ops.back().copy == copy && ops.back().offset + ops.back().length == offset)
+        {
+            ops.back().length += length;
+            return;
+        }
+        ops.push_back({copy, offset, length});
+    };
+
+    std::unordered_multimap<std::uint32_t, std::size_t> blocks;
+    for (int i = 0; i < signatures.size(); i++)
+    {
+        blocks.emplace(signatures.Get(i).weak(), i);
+    }
+
+    std::size_t position = 0;
+    std::size_t literal_start = 0;
+    DFSRollingChecksum rolling;
+    bool rolling_valid = false;
+    while (block_size > 0 && !blocks.empty() && position + block_size <= size)
+    {
+        if (!rolling_valid)
+        {
+            rolling.Reset(data + position, block_size);
+            rolling_valid = true;
+        }
+
+        bool matched = false;
+        auto candidates = blocks.equal_range(rolling.Value());
+        if (candidates.first != candidates.second)
+        {
+            std::uint32_t strong = CRC::Calculate(data + position, block_size, *crc_table);
+            for (auto candidate = candidates.first; candidate != candidates.second; ++candidate)
+            {
+                if (signatures.Get(candidate->second).strong() == strong)
+                {
+                    add_op(false, literal_start, position - literal_start);
+                    add_op(true, candidate->second * block_size, block_size);
+                    position += block_size;
+                    literal_start = position;
+                    rolling_valid = false;
+                    matched = true;
+                    break;
+                }
+            }
+        }
+
+        if (!matched)
+        {
+            if (position + block_size < size)
+            {
+                rolling.Roll(data[position], data[position + block_size]);
+            }
+            position++;
+        }
+    }
+    add_op(false, literal_start, size - literal_start);
+    return ops;
+}
+
+bool dfs_is_compressible(const char *data, std::size_t size)
+{
+    std::size_t sample = std::min<std::size_t>(size, DFS_ENTROPY_SAMPLE_BYTES);
+    if (sample == 0)
+    {
+        return false;
+    }
+
+    std::size_t counts[256] = {0};
+    for (std::size_t i = 0; i < sample; i++)
+    {
+        counts[static_cast<unsigned char>(data[i])]++;
+    }
+
+    double entropy = 0;
+    for (std::size_t count : counts)
+    {
+        if (count > 0)
+        {
+            double p = static_cast<double>(count) / sample;
+            entropy -= p * std::log2(p);
+        }
+    }
+    return entropy <= DFS_ENTROPY_MAX_BITS;
+}
+
+bool dfs_env_compression_level(grpc_compression_level *level)
+{
+    const char *value = std::getenv(DFS_COMPRESSION_LEVEL_ENV);
+    if (value == nullptr)
+    {
+        return false;
+    }
+
+    static const std::unordered_map<std::string, grpc_compression_level> levels = {
+        {"none", GRPC_COMPRESS_LEVEL_NONE},
+        {"low", GRPC_COMPRESS_LEVEL_LOW},
+        {"medium", GRPC_COMPRESS_LEVEL_MED},
+        {"high", GRPC_COMPRESS_LEVEL_HIGH}};
+    auto found = levels.find(value);
+    if (found == levels.end())
+    {
+        dfs_log(LL_ERROR) << "Ignoring unknown " << DFS_COMPRESSION_LEVEL_ENV << " value " << value;
+        return false;
+    }
+    *level = found->second;
+    return true;
+}
+
+DFSMappedFile::DFSMappedFile() : fd(-1), data(nullptr), size(0), filestat() {}
+
+DFSMappedFile::~DFSMappedFile()
+{
+    Close();
+}
+
+bool DFSMappedFile::Open(const std::string &path)
+{
+    Close();
+
+    this->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (this->fd < 0)
+    {
+        return false;
+    }
+
+    if (fstat(this->fd, &this->filestat) != 0)
+    {
+        Close();
+        return false;
+    }
+
+    // mmap rejects zero-length mappings, an empty file just has no data
+    this->size = static_cast<std::size_t>(this->filestat.st_size);
+    if (this->size > 0)
+    {
+        void *mapped = mmap(nullptr, this->size, PROT_READ, MAP_SHARED, this->fd, 0);
+        if (mapped == MAP_FAILED)
+        {
+            Close();
+            return false;
+        }
+        this->data = static_cast<char *>(mapped);
+    }
+    return true;
+}
+
+void DFSMappedFile::Prefetch(std::size_t offset, std::size_t length) const
+{
+    if (this->data == nullptr || offset >= this->size)
+    {
+        return;
+    }
+    length = std::min(length, this->size - offset);
+
+    // madvise wants a page aligned start
+    std::size_t page_size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    std::size_t start = offset / page_size * page_size;
+    madvise(this->data + start, length + (offset - start), MADV_WILLNEED);
+}
+
+void DFSMappedFile::AdviseSequential(std::size_t offset, std::size_t length) const
+{
+    if (this->data == nullptr || offset >= this->size)
+    {
+        return;
+    }
+    length = std::min(length, this->size - offset);
+
+    std::size_t page_size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    std::size_t start = offset / page_size * page_size;
+    madvise(this->data + start, length + (offset - start), MADV_SEQUENTIAL);
+    posix_fadvise(this->fd, offset, length, POSIX_FADV_SEQUENTIAL);
+}
+
+void DFSMappedFile::Release(std::size_t offset, std::size_t length) const
+{
+    if (this->data == nullptr || offset >= this->size)
+    {
+        return;
+    }
+    length = std::min(length, this->size - offset);
+
+    // only pages that were read all the way through
+    std::size_t page_size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    std::size_t start = offset / page_size * page_size;
+    std::size_t end = (offset + length) / page_size * page_size;
+    if (offset + length == this->size)
+    {
+        end = offset + length;
+    }
+    if (end <= start)
+    {
+        return;
+    }
+    madvise(this->data + start, end - start, MADV_DONTNEED);
+    posix_fadvise(this->fd, start, end - start, POSIX_FADV_DONTNEED);
+}
+
+void DFSMappedFile::Close()
+{
+    if (this->data != nullptr)
+    {
+        munmap(this->data, this->size);
+        this->data = nullptr;
+    }
+    if (this->fd >= 0)
+    {
+        close(this->fd);
+        this->fd = -1;
+    }
+    this->size = 0;
+}
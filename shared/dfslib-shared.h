@@ -5,10 +5,12 @@
 #include <cctype>
 #include <locale>
 #include <cstddef>
+#include <cstdint>
 #include <iostream>
 #include <sstream>
 #include <fstream>
 #include <string>
+#include <vector>
 #include <thread>
 #include <sys/stat.h>
 
@@ -19,6 +21,17 @@
 #define DFS_I_EVENT_SIZE (sizeof(struct inotify_event))
 #define DFS_I_BUFFER_SIZE (1024 * (DFS_I_EVENT_SIZE + 16))
 
+/** Number of file bytes carried by each streamed chunk message **/
+#ifndef DFS_CHUNK_SIZE
+#define DFS_CHUNK_SIZE (256 * 1024)
+#endif
+
+/**
+ * Prefix of the temporary files downloads are staged in inside the client mount.
+ * Clients never store them and the server refuses and hides the name.
+ */
+#define DFS_FETCH_TEMP_PREFIX ".dfs-fetch-"
+
 /** A file descriptor type **/
 typedef int FileDescriptor;
 
@@ -44,5 +57,223 @@ struct EventStruct {
 };
 
 
+/** Bounds of the block size used for delta transfer signatures **/
+#ifndef DFS_DELTA_MIN_BLOCK
+#define DFS_DELTA_MIN_BLOCK (2 * 1024)
+#endif
+#ifndef DFS_DELTA_MAX_BLOCKS
+#define DFS_DELTA_MAX_BLOCKS (64 * 1024)
+#endif
+
+/**
+ * The rsync rolling checksum of a window of bytes.
+ *
+ * Sliding the window forward by one byte is O(1), which lets a delta
+ * transfer test every offset of a file against a set of block signatures.
+ */
+class DFSRollingChecksum {
+
+public:
+    /**
+     * Compute the checksum of a new window
+     *
+     * @param data
+     * @param size
+     */
+    void Reset(const char* data, std::size_t size);
+
+    /**
+     * Slide the window forward by one byte
+     *
+     * @param out the byte leaving the window
+     * @param in the byte entering the window
+     */
+    void Roll(unsigned char out, unsigned char in);
+
+    std::uint32_t Value() const { return (this->b << 16) | this->a; }
+
+private:
+    std::uint32_t a = 0;
+    std::uint32_t b = 0;
+    std::uint32_t size = 0;
+};
+
+/**
+ * Block size used for the delta signatures of a file: about the square
+ * root of its size, and large enough to keep the signature count under
+ * DFS_DELTA_MAX_BLOCKS.
+ *
+ * @param file_size
+ * @return
+ */
+std::size_t dfs_delta_block_size(std::size_t file_size);
+
+/** Signatures of the blocks of a basis file, as sent over the wire **/
+typedef google::protobuf::RepeatedPtrField<dfs_service::SignatureResponse::BlockSignature> DFSBlockSignatures;
+
+/**
+ * Compute the signature of every full block of a file. A trailing
+ * partial block gets no signature and always travels as literal data.
+ *
+ * @param data
+ * @param size
+ * @param block_size
+ * @param crc_table
+ * @param signatures filled with one entry per full block
+ */
+void dfs_block_signatures(const char* data, std::size_t size, std::size_t block_size,
+                          CRC::Table<std::uint32_t, 32>* crc_table, DFSBlockSignatures* signatures);
+
+/** One step of a delta: copy a range of the basis, or send a range of the new file literally **/
+struct DFSDeltaOp {
+    bool copy;
+    std::int64_t offset;
+    std::int64_t length;
+};
+
+/**
+ * Diff a file against the block signatures of a basis.
+ *
+ * Every byte offset of the file is tested with the rolling checksum; a window
+ * whose checksum and CRC match a basis block becomes a copy of that block,
+ * everything else a literal range. Adjacent ops of the same kind are merged.
+ *
+ * @param data
+ * @param size
+ * @param block_size
+ * @param signatures
+ * @param crc_table
+ * @return the ops that rebuild the file from the basis, in file order
+ */
+std::vector<DFSDeltaOp> dfs_compute_delta(const char* data, std::size_t size, std::size_t block_size,
+                                          const DFSBlockSignatures& signatures,
+                                          CRC::Table<std::uint32_t, 32>* crc_table);
+
+/** Number of leading bytes of a file sampled to decide whether to compress it **/
+#ifndef DFS_ENTROPY_SAMPLE_BYTES
+#define DFS_ENTROPY_SAMPLE_BYTES (64 * 1024)
+#endif
+
+/** Sampled entropy in bits per byte above which a file is sent uncompressed **/
+#ifndef DFS_ENTROPY_MAX_BITS
+#define DFS_ENTROPY_MAX_BITS 7.5
+#endif
+
+/**
+ * Estimate whether transfer compression would pay off for a file by
+ * measuring the byte entropy of its first DFS_ENTROPY_SAMPLE_BYTES.
+ * Images, archives and encrypted data sit close to 8 bits per byte.
+ *
+ * @param data the start of the file
+ * @param size
+ * @return false if the sample looks incompressible
+ */
+bool dfs_is_compressible(const char* data, std::size_t size);
+
+/** Environment variable overriding the compiled-in transfer compression level **/
+#ifndef DFS_COMPRESSION_LEVEL_ENV
+#define DFS_COMPRESSION_LEVEL_ENV "DFS_COMPRESSION_LEVEL"
+#endif
+
+/**
+ * Read the transfer compression level from DFS_COMPRESSION_LEVEL_ENV,
+ * one of none, low, medium or high.
+ *
+ * @param level left untouched when the variable is unset or invalid
+ * @return true if a level was read
+ */
+bool dfs_env_compression_level(grpc_compression_level* level);
+
+/**
+ * Write the whole buffer to a file descriptor at the given offset,
+ * retrying short and interrupted writes.
+ *
+ * @param fd
+ * @param data
+ * @param size
+ * @param offset
+ * @return false if the write failed
+ */
+bool dfs_pwrite_all(FileDescriptor fd, const char* data, std::size_t size, off_t offset);
+
+/**
+ * Write a range of a file back to disk and drop it from the page cache,
+ * so streaming a large file does not evict everyone else's hot pages.
+ *
+ * @param fd
+ * @param offset
+ * @param length
+ */
+void dfs_drop_written(FileDescriptor fd, off_t offset, off_t length);
+
+/**
+ * A read-only memory mapping of a file.
+ *
+ * The transfer paths slice chunks straight out of the mapping
+ * instead of staging them through a stream buffer first.
+ */
+class DFSMappedFile {
+
+public:
+    DFSMappedFile();
+    ~DFSMappedFile();
+
+    DFSMappedFile(const DFSMappedFile&) = delete;
+    DFSMappedFile& operator=(const DFSMappedFile&) = delete;
+
+    /**
+     * Open and map the file at the given path
+     *
+     * @param path
+     * @return false if the file cannot be opened or mapped
+     */
+    bool Open(const std::string& path);
+
+    /** Unmap and close the file **/
+    void Close();
+
+    /** Start of the mapping (nullptr for an empty file) **/
+    const char* Data() const { return this->data; }
+
+    /** Size of the file when it was mapped **/
+    std::size_t Size() const { return this->size; }
+
+    /** The stat taken when the file was mapped **/
+    const struct stat& Stat() const { return this->filestat; }
+
+    /**
+     * Ask the kernel to start reading a range of the mapping in the
+     * background so it is resident by the time it is touched
+     *
+     * @param offset
+     * @param length
+     */
+    void Prefetch(std::size_t offset, std::size_t length) const;
+
+    /**
+     * Tell the kernel a range will be read front to back, so it reads
+     * ahead aggressively and can reclaim the pages behind the reader
+     *
+     * @param offset
+     * @param length
+     */
+    void AdviseSequential(std::size_t offset, std::size_t length) const;
+
+    /**
+     * Drop the whole pages of a range that has been read from the page
+     * cache, for files streamed once that should not stay resident
+     *
+     * @param offset
+     * @param length
+     */
+    void Release(std::size_t offset, std::size_t length) const;
+
+private:
+    FileDescriptor fd;
+    char* data;
+    std::size_t size;
+    struct stat filestat;
+};
+
 #endif
 